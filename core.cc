@@ -7,12 +7,23 @@
 #include <unordered_map>
 #include <string>
 #include <assert.h>
+#include <atomic>
 #include <mutex>
 #include <uv.h>
-#include <functional>
-#include <queue>
 #include <utility>
+#include <memory>
+#include <list>
+#include <deque>
+#include <algorithm>
 #include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "ice-api-v4/metadata.h"
 #include "ice-api-v4/glue.h"
@@ -36,49 +47,254 @@ enum NativeResourceType {
     NR_RpcCallContext,
     NR_RpcParam,
     NR_RpcClient,
-    NR_RpcClientConnection
+    NR_RpcClientConnection,
+    NR_HttpBodyStream,
+    NR_HttpResponseBodyWriter,
+    NR_HttpHeaderSet,
+    NR_HttpResponseTemplate,
+    NR_HttpRouter,
+    NR_RpcPreparedCall,
+    NR_RpcClientPool,
+    NR_TypeCount
 };
 
-struct AsyncCallbackInfo {
-    std::function<void()> executor;
-    AsyncCallbackInfo(std::function<void()> _executor) {
-        executor = _executor;
+static const char *native_resource_type_names[] = {
+    "Invalid",
+    "HttpServerConfig",
+    "HttpServer",
+    "HttpRouteInfo",
+    "HttpEndpointContext",
+    "HttpRequest",
+    "HttpResponse",
+    "RpcServerConfig",
+    "RpcServer",
+    "RpcCallContext",
+    "RpcParam",
+    "RpcClient",
+    "RpcClientConnection",
+    "HttpBodyStream",
+    "HttpResponseBodyWriter",
+    "HttpHeaderSet",
+    "HttpResponseTemplate",
+    "HttpRouter",
+    "RpcPreparedCall",
+    "RpcClientPool"
+};
+
+// Rough native footprint of each resource type, reported to V8 so that
+// wrappers holding on to native memory put pressure on the GC.
+static const int native_resource_size_hints[] = {
+    0,      // Invalid
+    256,    // HttpServerConfig
+    0,      // HttpServer
+    128,    // HttpRouteInfo
+    0,      // HttpEndpointContext
+    1024,   // HttpRequest
+    512,    // HttpResponse
+    256,    // RpcServerConfig
+    0,      // RpcServer
+    0,      // RpcCallContext
+    64,     // RpcParam
+    256,    // RpcClient
+    4096,   // RpcClientConnection
+    64,     // HttpBodyStream
+    64,     // HttpResponseBodyWriter
+    256,    // HttpHeaderSet
+    512,    // HttpResponseTemplate
+    1024,   // HttpRouter
+    64,     // RpcPreparedCall
+    4096    // RpcClientPool
+};
+
+// Number of owned resources currently held by JS wrappers, per type.
+int native_resource_live_count[NR_TypeCount] = { 0 };
+
+// Fixed-size nodes (anything with a `next` pointer) carved out of slabs
+// that are never freed. Each thread allocates from a private free list and
+// takes over the shared one wholesale when it runs dry; released nodes are
+// pushed back onto the shared list, one batch at a time where possible.
+// Only exchange and CAS-push are used on the shared list, so there is no
+// ABA hazard.
+template<class T, int SLAB_SIZE> class NodePool {
+    static std::atomic<T *> shared_free_list;
+    static thread_local T *local_free_list;
+
+public:
+
+    static T * alloc() {
+        T *node = local_free_list;
+
+        if(node == NULL) {
+            node = shared_free_list.exchange(NULL);
+        }
+
+        if(node == NULL) {
+            node = new T [SLAB_SIZE];
+            for(int i = 0; i < SLAB_SIZE - 1; i++) {
+                node[i].next = &node[i + 1];
+            }
+            node[SLAB_SIZE - 1].next = NULL;
+        }
+
+        local_free_list = node -> next;
+        return node;
+    }
+
+    // `first` .. `last` must already be linked through `next`.
+    static void release(T *first, T *last) {
+        T *head = shared_free_list.load(std::memory_order_relaxed);
+
+        do {
+            last -> next = head;
+        } while(!shared_free_list.compare_exchange_weak(head, first));
     }
 };
 
-std::mutex async_callback_queue_lock;
-std::queue<AsyncCallbackInfo> async_callback_queue;
+template<class T, int SLAB_SIZE> std::atomic<T *> NodePool<T, SLAB_SIZE>::shared_free_list(NULL);
+template<class T, int SLAB_SIZE> thread_local T *NodePool<T, SLAB_SIZE>::local_free_list = NULL;
+
+enum AsyncEventKind {
+    AE_HttpRoute,
+    AE_HttpBodyData,
+    AE_HttpBodyEnd,
+    AE_HttpBodyResume,
+    AE_HttpBodyFull,
+    AE_HttpRouterMatch,
+    AE_RpcMethodCall,
+    AE_RpcClientConnect,
+    AE_RpcCallReturn,
+    AE_RpcBatchReturn,
+    AE_RpcPoolConnect,
+    AE_RpcPoolCallReturn
+};
+
+struct AsyncEvent {
+    AsyncEvent *next;
+    AsyncEventKind kind;
+    void *p0;
+    void *p1;
+    void *p2;
+    ice_uint32_t len;
+};
+
+// Intrusive MPSC stack. Producers push with CAS; the JS thread swaps out
+// the whole list at once and reverses it into FIFO order.
+std::atomic<AsyncEvent *> async_event_queue(NULL);
+
+// Set while a wakeup is pending or the JS thread is draining the queue,
+// so that producers can skip the uv_async_send.
+std::atomic<bool> async_event_notified(false);
+
+typedef NodePool<AsyncEvent, 256> AsyncEventPool;
+
 uv_async_t global_async_handle;
 
+// When set, each wakeup drains the queue inside a single callback scope so
+// that microtasks and nextTicks run once per batch instead of per event.
+bool batched_dispatch = false;
+Persistent<Object> *callback_receiver = NULL;
+
+// Upper bounds on the work done per wakeup; zero means unlimited. Events
+// left over when a bound is hit stay in deferred_async_events (in FIFO
+// order) and are dispatched first on the next wakeup.
+unsigned int dispatch_budget_max_events = 0;
+uint64_t dispatch_budget_max_ns = 0;
+AsyncEvent *deferred_async_events = NULL;
+
+struct DispatchStats {
+    uint64_t wakeups;
+    uint64_t events;
+    uint64_t budget_hits_events;
+    uint64_t budget_hits_time;
+};
+
+DispatchStats dispatch_stats = { 0, 0, 0, 0 };
+
+// Constructor for wrapper objects, created once. The addon only ever runs
+// in the main isolate, so a single cached instance is enough.
+Persistent<Function> *nr_object_constructor = NULL;
 Persistent<FunctionTemplate> *nr_object_template = NULL;
+
+static void on_native_resource_collected(const WeakCallbackInfo<Persistent<Object>>& info);
+
+// Internal field 0 holds the resource type and an ownership bit, scaled so
+// that it passes as an aligned pointer. Owned resources are released by
+// the wrapper's weak callback unless they have been reset before.
 class NativeResource {
     NativeResourceType type;
     void *data;
 
-public:
+    static void * encode_tag(NativeResourceType type, bool owned) {
+        return (void *) ((((unsigned long) type << 1) | (owned ? 1 : 0)) * sizeof(long));
+    }
 
-    NativeResource(NativeResourceType _type, void *_data) {
-        type = _type;
-        data = _data;
+    static NativeResourceType decode_type(void *tag) {
+        return (NativeResourceType) ((((unsigned long) tag) / sizeof(long)) >> 1);
     }
 
-    Local<Object> build_object(Isolate *isolate) {
-        if(nr_object_template == NULL) {
+    static bool decode_owned(void *tag) {
+        return (((unsigned long) tag) / sizeof(long)) & 1;
+    }
+
+    Local<Object> build_object(Isolate *isolate, bool owned) {
+        Local<Context> context = isolate -> GetCurrentContext();
+
+        if(nr_object_constructor == NULL) {
             Local<FunctionTemplate> t = FunctionTemplate::New(isolate);
             t -> InstanceTemplate() -> SetInternalFieldCount(2);
 
             nr_object_template = new Persistent<FunctionTemplate>(isolate, t);
+            nr_object_constructor = new Persistent<Function>(
+                isolate,
+                t -> GetFunction(context).ToLocalChecked()
+            );
         }
 
-        Local<FunctionTemplate> ft = Local<FunctionTemplate>::New(isolate, *nr_object_template);
+        Local<Function> ctor = Local<Function>::New(isolate, *nr_object_constructor);
+        Local<Object> ret = ctor -> NewInstance(context).ToLocalChecked();
+
+        int indices[] = { 0, 1 };
+        void *values[] = { encode_tag(type, owned), data };
+        ret -> SetAlignedPointerInInternalFields(2, indices, values);
+
+        return ret;
+    }
+
+public:
+
+    NativeResource(NativeResourceType _type, void *_data) {
+        type = _type;
+        data = _data;
+    }
+
+    // Wraps a resource whose lifetime is managed by the core or by another
+    // resource. Nothing happens when the wrapper is collected.
+    Local<Object> build_object(Isolate *isolate) {
+        return build_object(isolate, false);
+    }
+
+    // Wraps a resource owned by JS. It is released when the wrapper is
+    // collected, unless it was destroyed or handed over (reset) before.
+    Local<Object> build_owned_object(Isolate *isolate) {
+        Local<Object> ret = build_object(isolate, true);
 
-        Local<Object> ret = ft -> GetFunction() -> NewInstance(isolate -> GetCurrentContext()).ToLocalChecked();
-        ret -> SetAlignedPointerInInternalField(0, (void *) (type * sizeof(long)));
-        ret -> SetAlignedPointerInInternalField(1, data);
+        auto handle = new Persistent<Object>(isolate, ret);
+        handle -> SetWeak(handle, on_native_resource_collected, WeakCallbackType::kInternalFields);
 
+        acquired(isolate, type);
         return ret;
     }
 
+    static void acquired(Isolate *isolate, NativeResourceType type) {
+        native_resource_live_count[type]++;
+        isolate -> AdjustAmountOfExternalAllocatedMemory(native_resource_size_hints[type]);
+    }
+
+    static void released(Isolate *isolate, NativeResourceType type) {
+        native_resource_live_count[type]--;
+        isolate -> AdjustAmountOfExternalAllocatedMemory(-native_resource_size_hints[type]);
+    }
+
     NativeResourceType get_type() {
         return type;
     }
@@ -87,59 +303,450 @@ public:
         return data;
     }
 
+    // Whether `v` is a wrapper built by this class. Other objects, such as
+    // ArrayBufferViews, may have two internal fields as well.
+    static bool is_wrapper(Isolate *isolate, Local<Value> v) {
+        if(nr_object_template == NULL || !v -> IsObject()) {
+            return false;
+        }
+        return Local<FunctionTemplate>::New(isolate, *nr_object_template) -> HasInstance(v);
+    }
+
     static NativeResource from_object(Local<Object> obj) {
         assert(obj -> InternalFieldCount() == 2);
-        NativeResourceType _type = (NativeResourceType) (((unsigned long) obj -> GetAlignedPointerFromInternalField(0)) / sizeof(long));
+        NativeResourceType _type = decode_type(obj -> GetAlignedPointerFromInternalField(0));
         void *_data = obj -> GetAlignedPointerFromInternalField(1);
         return NativeResource(_type, _data);
     }
 
+    static NativeResource from_collected(const WeakCallbackInfo<Persistent<Object>>& info, bool *owned) {
+        void *tag = info.GetInternalField(0);
+        *owned = decode_owned(tag);
+        return NativeResource(decode_type(tag), info.GetInternalField(1));
+    }
+
     static void reset_object(Local<Object> obj) {
         assert(obj -> InternalFieldCount() == 2);
+
+        void *tag = obj -> GetAlignedPointerFromInternalField(0);
+        if(decode_owned(tag) && obj -> GetAlignedPointerFromInternalField(1) != NULL) {
+            released(obj -> GetIsolate(), decode_type(tag));
+        }
+
         obj -> SetAlignedPointerInInternalField(0, NULL);
         obj -> SetAlignedPointerInInternalField(1, NULL);
     }
 };
 
-static void handle_async_callback(uv_async_t *async_info) {
-    while(true) {
-        async_callback_queue_lock.lock();
+// Callbacks of routes and RPC server configs that have not been handed to
+// a server yet. Once handed over they live as long as the server does.
+std::unordered_map<IceHttpRouteInfo, Persistent<Function> *> pending_route_callbacks;
+std::unordered_map<IceRpcServerConfig, std::vector<Persistent<Function> *>> pending_rpc_method_callbacks;
+
+struct RequestBodyReadContext;
+static void body_stream_handle_released(RequestBodyReadContext *callbackCtx);
+
+struct HttpRouter;
+static void http_router_destroy(HttpRouter *router);
+
+struct PreparedRpcCall;
+static void rpc_prepared_call_destroy(PreparedRpcCall *call);
+
+struct RpcClientPool;
+static void rpc_client_pool_close(RpcClientPool *pool);
+
+// Off-heap buffer a response body is accumulated into piece by piece and
+// then copied into the response, as the core cannot stream responses. The
+// storage is reported to V8 as external memory as it grows.
+struct ResponseBodyWriter {
+    char *buf;
+    size_t len;
+    size_t cap;
+
+    ResponseBodyWriter() {
+        buf = NULL;
+        len = 0;
+        cap = 0;
+    }
+
+    ~ResponseBodyWriter() {
+        if(buf) {
+            free(buf);
+            Isolate::GetCurrent() -> AdjustAmountOfExternalAllocatedMemory(-(int64_t) cap);
+        }
+    }
+
+    char * reserve(size_t n) {
+        if(len + n > cap) {
+            size_t new_cap = cap ? cap * 2 : 16384;
+            while(new_cap < len + n) new_cap *= 2;
+
+            buf = (char *) realloc(buf, new_cap);
+            assert(buf);
+            Isolate::GetCurrent() -> AdjustAmountOfExternalAllocatedMemory((int64_t) (new_cap - cap));
+            cap = new_cap;
+        }
+        return buf + len;
+    }
+};
+
+struct ResponseHeader {
+    std::string key;
+    std::string value;
+    bool from_set;
+};
+
+// Headers built once and attached to any number of responses.
+struct HttpHeaderSet {
+    std::vector<ResponseHeader> headers;
+};
+
+// A complete response kept natively; every send builds a fresh
+// IceHttpResponse from it without touching JS values.
+struct HttpResponseTemplate {
+    ice_uint16_t status;
+    std::vector<ResponseHeader> headers;
+    std::vector<char> body;
+};
+
+static void release_persistent_function(Persistent<Function> *f) {
+    f -> Reset();
+    delete f;
+}
+
+static void release_native_resource(NativeResourceType type, void *data) {
+    switch(type) {
+        case NR_HttpServerConfig:
+            ice_http_server_config_destroy((IceHttpServerConfig) data);
+            break;
+
+        case NR_HttpRouteInfo: {
+            auto it = pending_route_callbacks.find((IceHttpRouteInfo) data);
+            if(it != pending_route_callbacks.end()) {
+                release_persistent_function(it -> second);
+                pending_route_callbacks.erase(it);
+            }
+            ice_http_server_route_destroy((IceHttpRouteInfo) data);
+            break;
+        }
 
-        if(!async_callback_queue.size()) {
-            async_callback_queue_lock.unlock();
+        case NR_HttpRequest:
+            ice_http_request_destroy((IceHttpRequest) data);
+            break;
+
+        case NR_HttpResponse:
+            ice_http_response_destroy((IceHttpResponse) data);
+            break;
+
+        case NR_RpcServerConfig: {
+            auto it = pending_rpc_method_callbacks.find((IceRpcServerConfig) data);
+            if(it != pending_rpc_method_callbacks.end()) {
+                for(auto f : it -> second) {
+                    release_persistent_function(f);
+                }
+                pending_rpc_method_callbacks.erase(it);
+            }
+            ice_rpc_server_config_destroy((IceRpcServerConfig) data);
             break;
         }
 
-        auto cb_info = async_callback_queue.front();
-        async_callback_queue.pop();
-        async_callback_queue_lock.unlock();
+        case NR_RpcParam:
+            ice_rpc_param_destroy((IceRpcParam) data);
+            break;
+
+        case NR_RpcClient:
+            ice_rpc_client_destroy((IceRpcClient) data);
+            break;
+
+        case NR_RpcClientConnection:
+            ice_rpc_client_connection_destroy((IceRpcClientConnection) data);
+            break;
+
+        case NR_HttpBodyStream:
+            body_stream_handle_released((RequestBodyReadContext *) data);
+            break;
+
+        case NR_HttpResponseBodyWriter:
+            delete (ResponseBodyWriter *) data;
+            break;
+
+        case NR_HttpHeaderSet:
+            delete (HttpHeaderSet *) data;
+            break;
+
+        case NR_HttpResponseTemplate:
+            delete (HttpResponseTemplate *) data;
+            break;
+
+        case NR_HttpRouter:
+            http_router_destroy((HttpRouter *) data);
+            break;
+
+        case NR_RpcPreparedCall:
+            rpc_prepared_call_destroy((PreparedRpcCall *) data);
+            break;
+
+        case NR_RpcClientPool:
+            rpc_client_pool_close((RpcClientPool *) data);
+            break;
+
+        default:
+            assert(false);
+    }
+}
 
-        cb_info.executor();
+static void release_collected_native_resource(const WeakCallbackInfo<Persistent<Object>>& info) {
+    bool owned;
+    NativeResource res = NativeResource::from_collected(info, &owned);
+
+    if(!owned || res.get_data() == NULL) {
+        return;
     }
+
+    release_native_resource(res.get_type(), res.get_data());
+    NativeResource::released(info.GetIsolate(), res.get_type());
 }
 
-static void enqueue_executor(std::function<void()> executor) {
-    async_callback_queue_lock.lock();
-    async_callback_queue.push(AsyncCallbackInfo(executor));
-    async_callback_queue_lock.unlock();
-    uv_async_send(&global_async_handle);
+static void on_native_resource_collected(const WeakCallbackInfo<Persistent<Object>>& info) {
+    Persistent<Object> *handle = info.GetParameter();
+    handle -> Reset();
+    delete handle;
+
+    // Releasing may touch V8 (external memory accounting), which is not
+    // allowed in the first pass.
+    info.SetSecondPassCallback(release_collected_native_resource);
 }
 
-static Local<Value> build_string_from_ice_owned_string(Isolate *isolate, ice_owned_string_t os) {
-    if(os) {
-        auto s = String::NewFromUtf8(isolate, os);
-        ice_glue_destroy_cstring(os);
-        return s;
+static void enqueue_event(AsyncEventKind kind, void *p0, void *p1, void *p2, ice_uint32_t len) {
+    AsyncEvent *ev = AsyncEventPool::alloc();
+    ev -> kind = kind;
+    ev -> p0 = p0;
+    ev -> p1 = p1;
+    ev -> p2 = p2;
+    ev -> len = len;
+
+    AsyncEvent *head = async_event_queue.load(std::memory_order_relaxed);
+
+    do {
+        ev -> next = head;
+    } while(!async_event_queue.compare_exchange_weak(head, ev));
+
+    if(!async_event_notified.exchange(true)) {
+        uv_async_send(&global_async_handle);
+    }
+}
+
+static AsyncEvent * take_async_events() {
+    AsyncEvent *head = async_event_queue.exchange(NULL);
+    AsyncEvent *ordered = NULL;
+
+    while(head) {
+        AsyncEvent *next = head -> next;
+        head -> next = ordered;
+        ordered = head;
+        head = next;
+    }
+
+    return ordered;
+}
+
+static Local<Object> get_callback_receiver(Isolate *isolate) {
+    if(callback_receiver == NULL) {
+        callback_receiver = new Persistent<Object>(isolate, Object::New(isolate));
+    }
+    return Local<Object>::New(isolate, *callback_receiver);
+}
+
+static Local<Value> invoke_callback(Isolate *isolate, Local<Function> cb, int argc, Local<Value> argv[]) {
+    Local<Value> ret;
+
+    if(batched_dispatch) {
+        // Report exceptions here so that the enclosing callback scope is
+        // not marked as failed and still runs the tick queue.
+        TryCatch try_catch(isolate);
+        try_catch.SetVerbose(true);
+
+        MaybeLocal<Value> maybe_ret = cb -> Call(
+            isolate -> GetCurrentContext(),
+            get_callback_receiver(isolate),
+            argc,
+            argv
+        );
+        if(!maybe_ret.ToLocal(&ret)) {
+            return Undefined(isolate);
+        }
+    } else {
+        ret = node::MakeCallback(
+            isolate,
+            get_callback_receiver(isolate),
+            cb,
+            argc,
+            argv
+        );
+    }
+
+    if(ret.IsEmpty()) {
+        return Undefined(isolate);
+    }
+    return ret;
+}
+
+static bool is_ascii(const uint8_t *data, size_t len) {
+    uint8_t acc = 0;
+    for(size_t i = 0; i < len; i++) {
+        acc |= data[i];
+    }
+    return (acc & 0x80) == 0;
+}
+
+// NUL-terminated UTF-8 view of a JS value for passing into the ice core.
+// Short one-byte strings that turn out to be plain ASCII are copied into a
+// stack buffer directly; everything else goes through String::Utf8Value.
+class InboundString {
+    static const int STACK_BUF_SIZE = 256;
+
+    uint8_t stack_buf[STACK_BUF_SIZE];
+    std::unique_ptr<String::Utf8Value> utf8;
+    const char *str;
+
+public:
+
+    InboundString(Isolate *isolate, Local<Value> v) {
+        Local<String> s = v -> ToString();
+        int len = s -> Length();
+
+        if(len < STACK_BUF_SIZE && s -> IsOneByte()) {
+            s -> WriteOneByte(isolate, stack_buf, 0, len, String::NO_NULL_TERMINATION);
+            if(is_ascii(stack_buf, len)) {
+                stack_buf[len] = 0;
+                str = (const char *) stack_buf;
+                return;
+            }
+        }
+
+        utf8.reset(new String::Utf8Value(s));
+        str = **utf8;
+    }
+
+    const char * operator * () const {
+        return str;
+    }
+};
+
+// Lets V8 use an ice-owned string in place and free it on collection.
+class IceOwnedOneByteString : public String::ExternalOneByteStringResource {
+    ice_owned_string_t data_;
+    size_t length_;
+
+public:
+
+    IceOwnedOneByteString(ice_owned_string_t data, size_t length) {
+        data_ = data;
+        length_ = length;
+    }
+
+    ~IceOwnedOneByteString() {
+        ice_glue_destroy_cstring(data_);
+    }
+
+    const char * data() const {
+        return data_;
+    }
+
+    size_t length() const {
+        return length_;
+    }
+};
+
+// Owned strings at least this long are handed to V8 as external strings
+// instead of being copied.
+static const size_t EXTERNAL_STRING_MIN_LENGTH = 256;
+
+static Local<String> build_string_from_native(Isolate *isolate, const char *data, size_t len) {
+    if(is_ascii((const uint8_t *) data, len)) {
+        return String::NewFromOneByte(
+            isolate,
+            (const uint8_t *) data,
+            NewStringType::kNormal,
+            len
+        ).ToLocalChecked();
     } else {
+        return String::NewFromUtf8(
+            isolate,
+            data,
+            NewStringType::kNormal,
+            len
+        ).ToLocalChecked();
+    }
+}
+
+static Local<Value> build_string_from_ice_owned_string(Isolate *isolate, ice_owned_string_t os) {
+    if(os == NULL) {
+        return Null(isolate);
+    }
+
+    size_t len = strlen(os);
+
+    if(len >= EXTERNAL_STRING_MIN_LENGTH && is_ascii((const uint8_t *) os, len)) {
+        Local<String> s;
+        if(String::NewExternalOneByte(isolate, new IceOwnedOneByteString(os, len)).ToLocal(&s)) {
+            return s;
+        }
+    }
+
+    Local<String> s = build_string_from_native(isolate, os, len);
+    ice_glue_destroy_cstring(os);
+    return s;
+}
+
+static const char *interned_method_names[] = {
+    "GET",
+    "POST",
+    "PUT",
+    "DELETE",
+    "HEAD",
+    "OPTIONS",
+    "PATCH"
+};
+static const int N_INTERNED_METHOD_NAMES = sizeof(interned_method_names) / sizeof(const char *);
+Persistent<String> *interned_method_strings = NULL;
+
+// Request methods come from a tiny set, so hand out cached strings for the
+// common ones instead of building a new string per request.
+static Local<Value> build_method_string_from_ice_owned_string(Isolate *isolate, ice_owned_string_t os) {
+    if(os == NULL) {
         return Null(isolate);
     }
+
+    if(interned_method_strings == NULL) {
+        interned_method_strings = new Persistent<String> [N_INTERNED_METHOD_NAMES];
+        for(int i = 0; i < N_INTERNED_METHOD_NAMES; i++) {
+            interned_method_strings[i].Reset(
+                isolate,
+                String::NewFromOneByte(
+                    isolate,
+                    (const uint8_t *) interned_method_names[i],
+                    NewStringType::kInternalized
+                ).ToLocalChecked()
+            );
+        }
+    }
+
+    for(int i = 0; i < N_INTERNED_METHOD_NAMES; i++) {
+        if(strcmp(os, interned_method_names[i]) == 0) {
+            ice_glue_destroy_cstring(os);
+            return Local<String>::New(isolate, interned_method_strings[i]);
+        }
+    }
+
+    return build_string_from_ice_owned_string(isolate, os);
 }
 
 static void http_server_config_create(const FunctionCallbackInfo<Value>& args) {
     Isolate *isolate = args.GetIsolate();
     IceHttpServerConfig cfg = ice_http_server_config_create();
     NativeResource res(NR_HttpServerConfig, (void *) cfg);
-    args.GetReturnValue().Set(res.build_object(isolate));
+    args.GetReturnValue().Set(res.build_owned_object(isolate));
 }
 
 static void http_server_config_destroy(const FunctionCallbackInfo<Value>& args) {
@@ -160,7 +767,7 @@ static void http_server_config_set_listen_addr(const FunctionCallbackInfo<Value>
 
     IceHttpServerConfig cfg = (IceHttpServerConfig) res.get_data();
 
-    String::Utf8Value addr(args[1] -> ToString());
+    InboundString addr(args.GetIsolate(), args[1]);
     ice_http_server_config_set_listen_addr(cfg, *addr);
 }
 
@@ -196,42 +803,53 @@ static void http_server_start(const FunctionCallbackInfo<Value>& args) {
     ice_http_server_start(server);
 }
 
+static void dispatch_http_route(AsyncEvent *ev) {
+    auto cb = (Persistent<Function> *) ev -> p0;
+    auto ctx = (IceHttpEndpointContext) ev -> p1;
+    auto req = (IceHttpRequest) ev -> p2;
+
+    Isolate *isolate = Isolate::GetCurrent();
+    HandleScope scope(isolate);
+
+    Local<Function> local_cb = Local<Function>::New(isolate, *cb);
+
+    // The request line and peer address are needed by nearly every
+    // handler, so they are delivered up front instead of being fetched
+    // with separate calls.
+    Local<Value> argv[] = {
+        NativeResource(NR_HttpEndpointContext, (void *) ctx).build_object(isolate),
+        NativeResource(NR_HttpRequest, (void *) req).build_object(isolate),
+        build_method_string_from_ice_owned_string(isolate, ice_http_request_get_method_to_owned(req)),
+        build_string_from_ice_owned_string(isolate, ice_http_request_get_uri_to_owned(req)),
+        build_string_from_ice_owned_string(isolate, ice_http_request_get_remote_addr_to_owned(req))
+    };
+
+    invoke_callback(
+        isolate,
+        local_cb,
+        5,
+        argv
+    );
+}
+
 static void http_server_route_create(const FunctionCallbackInfo<Value>& args) {
     Isolate *isolate = args.GetIsolate();
 
-    String::Utf8Value path(args[0] -> ToString());
+    InboundString path(isolate, args[0]);
     Local<Function> _cb = Local<Function>::Cast(args[1]);
     auto cb = new Persistent<Function>(isolate, _cb);
 
     IceHttpRouteInfo rt = ice_http_server_route_create(
         *path,
         [](IceHttpEndpointContext ctx, IceHttpRequest req, void *call_with) {
-            auto cb = (Persistent<Function> *) call_with;
-            enqueue_executor([cb, ctx, req]() {
-                Isolate *isolate = Isolate::GetCurrent();
-                HandleScope scope(isolate);
-
-                Local<Function> local_cb = Local<Function>::New(isolate, *cb);
-                
-                Local<Value> argv[] = {
-                    NativeResource(NR_HttpEndpointContext, (void *) ctx).build_object(isolate),
-                    NativeResource(NR_HttpRequest, (void *) req).build_object(isolate)
-                };
-
-                node::MakeCallback(
-                    isolate,
-                    Object::New(isolate),
-                    local_cb,
-                    2,
-                    argv
-                );
-            });
+            enqueue_event(AE_HttpRoute, call_with, (void *) ctx, (void *) req, 0);
         },
         (void *) cb
     );
+    pending_route_callbacks[rt] = cb;
 
     NativeResource res(NR_HttpRouteInfo, (void *) rt);
-    args.GetReturnValue().Set(res.build_object(isolate));
+    args.GetReturnValue().Set(res.build_owned_object(isolate));
 }
 
 static void http_server_endpoint_context_end_with_response(
@@ -276,7 +894,7 @@ static void http_server_endpoint_context_take_request(
     assert(req != NULL);
 
     NativeResource reqRes(NR_HttpRequest, (void *) req);
-    args.GetReturnValue().Set(reqRes.build_object(isolate));
+    args.GetReturnValue().Set(reqRes.build_owned_object(isolate));
 }
 
 static void http_server_route_destroy(const FunctionCallbackInfo<Value>& args) {
@@ -285,9 +903,7 @@ static void http_server_route_destroy(const FunctionCallbackInfo<Value>& args) {
     NativeResource res = NativeResource::from_object(arg0);
     assert(res.get_type() == NR_HttpRouteInfo);
 
-    IceHttpRouteInfo rt = (IceHttpRouteInfo) res.get_data();
-    ice_http_server_route_destroy(rt);
-
+    release_native_resource(NR_HttpRouteInfo, res.get_data());
     NativeResource::reset_object(arg0);
 }
 
@@ -305,6 +921,7 @@ static void http_server_add_route(const FunctionCallbackInfo<Value>& args) {
     IceHttpRouteInfo rt = (IceHttpRouteInfo) rtRes.get_data();
 
     ice_http_server_add_route(server, rt);
+    pending_route_callbacks.erase(rt);
 
     NativeResource::reset_object(arg1);
 }
@@ -323,6 +940,7 @@ static void http_server_set_default_route(const FunctionCallbackInfo<Value>& arg
     IceHttpRouteInfo rt = (IceHttpRouteInfo) rtRes.get_data();
 
     ice_http_server_set_default_route(server, rt);
+    pending_route_callbacks.erase(rt);
 
     NativeResource::reset_object(arg1);
 }
@@ -335,7 +953,7 @@ static void http_response_create(const FunctionCallbackInfo<Value>& args) {
         (void *) ice_http_response_create()
     );
 
-    args.GetReturnValue().Set(res.build_object(isolate));
+    args.GetReturnValue().Set(res.build_owned_object(isolate));
 }
 
 static void http_response_destroy(const FunctionCallbackInfo<Value>& args) {
@@ -351,6 +969,66 @@ static void http_response_destroy(const FunctionCallbackInfo<Value>& args) {
     NativeResource::reset_object(target);
 }
 
+// The core copies response bodies, so pieces that are not already one
+// contiguous Buffer are gathered here first. The buffer is reused across
+// responses and trimmed when an unusually large body has passed through.
+static std::vector<char> body_gather_buffer;
+static const size_t BODY_GATHER_BUFFER_KEEP = 1048576;
+
+// Returns false, with a TypeError pending and the gathered data dropped,
+// if the part is neither a string nor a Buffer.
+static bool gather_body_part(Local<Value> part) {
+    if(part -> IsString()) {
+        Local<String> str = Local<String>::Cast(part);
+        size_t offset = body_gather_buffer.size();
+        size_t n = str -> Utf8Length();
+
+        body_gather_buffer.resize(offset + n);
+        str -> WriteUtf8(body_gather_buffer.data() + offset, n, NULL, String::NO_NULL_TERMINATION | String::REPLACE_INVALID_UTF8);
+    } else if(node::Buffer::HasInstance(part)) {
+        Local<Object> buf_obj = Local<Object>::Cast(part);
+        const char *data = node::Buffer::Data(buf_obj);
+        size_t n = node::Buffer::Length(buf_obj);
+
+        body_gather_buffer.insert(body_gather_buffer.end(), data, data + n);
+    } else {
+        body_gather_buffer.clear();
+
+        Isolate *isolate = Isolate::GetCurrent();
+        isolate -> ThrowException(Exception::TypeError(
+            String::NewFromUtf8(isolate, "Body parts must be strings or Buffers")
+        ));
+        return false;
+    }
+    return true;
+}
+
+static bool gather_body_parts(Local<Array> parts) {
+    unsigned int n_parts = parts -> Length();
+    for(unsigned int i = 0; i < n_parts; i++) {
+        if(!gather_body_part(parts -> Get(i))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void set_gathered_body(IceHttpResponse resp) {
+    ice_http_response_set_body(
+        resp,
+        (const ice_uint8_t *) body_gather_buffer.data(),
+        body_gather_buffer.size()
+    );
+
+    if(body_gather_buffer.capacity() > BODY_GATHER_BUFFER_KEEP) {
+        std::vector<char>().swap(body_gather_buffer);
+    } else {
+        body_gather_buffer.clear();
+    }
+}
+
+// Accepts either a Buffer or a string, which is encoded as UTF-8 without
+// going through an intermediate Buffer.
 static void http_response_set_body(const FunctionCallbackInfo<Value>& args) {
     Local<Object> target = args[0] -> ToObject();
     NativeResource res = NativeResource::from_object(
@@ -359,16 +1037,31 @@ static void http_response_set_body(const FunctionCallbackInfo<Value>& args) {
     assert(res.get_type() == NR_HttpResponse);
 
     IceHttpResponse resp = (IceHttpResponse) res.get_data();
+
+    if(args[1] -> IsString()) {
+        gather_body_part(args[1]);
+        set_gathered_body(resp);
+        return;
+    }
+    if(!node::Buffer::HasInstance(args[1])) {
+        Isolate *isolate = args.GetIsolate();
+        isolate -> ThrowException(Exception::TypeError(
+            String::NewFromUtf8(isolate, "Body must be a string or a Buffer")
+        ));
+        return;
+    }
+
     Local<Object> buf_obj = Local<Object>::Cast(args[1]);
 
     const ice_uint8_t *data = (ice_uint8_t *) node::Buffer::Data(buf_obj);
-    assert(data != NULL);
-
     ice_uint32_t data_len = node::Buffer::Length(buf_obj);
+    assert(data != NULL || data_len == 0);
+
     ice_http_response_set_body(resp, data, data_len);
 }
 
-static void http_response_set_status(const FunctionCallbackInfo<Value>& args) {
+// Sets the body from an array of Buffers and strings in one call.
+static void http_response_set_body_v(const FunctionCallbackInfo<Value>& args) {
     Local<Object> target = args[0] -> ToObject();
     NativeResource res = NativeResource::from_object(
         target
@@ -376,732 +1069,3921 @@ static void http_response_set_status(const FunctionCallbackInfo<Value>& args) {
     assert(res.get_type() == NR_HttpResponse);
 
     IceHttpResponse resp = (IceHttpResponse) res.get_data();
+    if(!gather_body_parts(Local<Array>::Cast(args[1]))) {
+        return;
+    }
+    set_gathered_body(resp);
+}
 
-    ice_uint16_t status = args[1] -> NumberValue();
-    ice_http_response_set_status(resp, status);
+// Returns NULL, with an exception pending, if the writer has already been
+// finished or destroyed.
+static ResponseBodyWriter * body_writer_from_object(Isolate *isolate, Local<Object> target) {
+    NativeResource res = NativeResource::from_object(target);
+    if(res.get_data() == NULL) {
+        isolate -> ThrowException(Exception::Error(
+            String::NewFromUtf8(isolate, "Response body writer already finished")
+        ));
+        return NULL;
+    }
+    assert(res.get_type() == NR_HttpResponseBodyWriter);
+    return (ResponseBodyWriter *) res.get_data();
 }
 
-static void http_response_set_header(const FunctionCallbackInfo<Value>& args) {
-    Local<Object> target = args[0] -> ToObject();
-    NativeResource res = NativeResource::from_object(
-        target
-    );
-    assert(res.get_type() == NR_HttpResponse);
+static void http_response_body_writer_create(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
 
-    IceHttpResponse resp = (IceHttpResponse) res.get_data();
+    args.GetReturnValue().Set(
+        NativeResource(NR_HttpResponseBodyWriter, (void *) new ResponseBodyWriter()).build_owned_object(isolate)
+    );
+}
 
-    String::Utf8Value key(args[1] -> ToString());
-    String::Utf8Value value(args[2] -> ToString());
+// Appends a Buffer or a string (encoded as UTF-8 straight into the writer)
+// and returns the number of bytes buffered so far.
+static void http_response_body_writer_write(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
 
-    ice_http_response_set_header(resp, *key, *value);
-}
+    ResponseBodyWriter *writer = body_writer_from_object(isolate, args[0] -> ToObject());
+    if(writer == NULL) {
+        return;
+    }
 
-static void http_response_append_header(const FunctionCallbackInfo<Value>& args) {
-    Local<Object> target = args[0] -> ToObject();
-    NativeResource res = NativeResource::from_object(
-        target
-    );
-    assert(res.get_type() == NR_HttpResponse);
-
-    IceHttpResponse resp = (IceHttpResponse) res.get_data();
-
-    String::Utf8Value key(args[1] -> ToString());
-    String::Utf8Value value(args[2] -> ToString());
+    if(args[1] -> IsString()) {
+        Local<String> str = Local<String>::Cast(args[1]);
+        size_t n = str -> Utf8Length();
+        char *dst = writer -> reserve(n);
+        str -> WriteUtf8(dst, n, NULL, String::NO_NULL_TERMINATION | String::REPLACE_INVALID_UTF8);
+        writer -> len += n;
+    } else {
+        Local<Object> buf_obj = Local<Object>::Cast(args[1]);
+        size_t n = node::Buffer::Length(buf_obj);
+        if(n) {
+            memcpy(writer -> reserve(n), node::Buffer::Data(buf_obj), n);
+            writer -> len += n;
+        }
+    }
 
-    ice_http_response_append_header(resp, *key, *value);
+    args.GetReturnValue().Set(Number::New(isolate, (double) writer -> len));
 }
 
-static void http_request_destroy(const FunctionCallbackInfo<Value>& args) {
+// Moves everything written so far into the response body and releases
+// the writer.
+static void http_response_body_writer_finish(const FunctionCallbackInfo<Value>& args) {
     Local<Object> target = args[0] -> ToObject();
-    NativeResource res = NativeResource::from_object(
-        target
+    ResponseBodyWriter *writer = body_writer_from_object(args.GetIsolate(), target);
+    if(writer == NULL) {
+        return;
+    }
+
+    Local<Object> resp_obj = args[1] -> ToObject();
+    NativeResource resp_res = NativeResource::from_object(
+        resp_obj
+    );
+    assert(resp_res.get_type() == NR_HttpResponse);
+
+    ice_http_response_set_body(
+        (IceHttpResponse) resp_res.get_data(),
+        (const ice_uint8_t *) writer -> buf,
+        writer -> len
     );
-    assert(res.get_type() == NR_HttpRequest);
-    IceHttpRequest req = (IceHttpRequest) res.get_data();
 
-    ice_http_request_destroy(req);
     NativeResource::reset_object(target);
+    delete writer;
 }
 
-static void http_request_get_uri(const FunctionCallbackInfo<Value>& args) {
-    Isolate *isolate = args.GetIsolate();
-
+static void http_response_body_writer_destroy(const FunctionCallbackInfo<Value>& args) {
     Local<Object> target = args[0] -> ToObject();
-    NativeResource res = NativeResource::from_object(
-        target
-    );
-    assert(res.get_type() == NR_HttpRequest);
-    IceHttpRequest req = (IceHttpRequest) res.get_data();
+    ResponseBodyWriter *writer = body_writer_from_object(args.GetIsolate(), target);
+    if(writer == NULL) {
+        return;
+    }
 
-    args.GetReturnValue().Set(
-        build_string_from_ice_owned_string(
-            isolate,
-            ice_http_request_get_uri_to_owned(req)
-        )
-    );
+    NativeResource::reset_object(target);
+    delete writer;
 }
 
-static void http_request_get_method(const FunctionCallbackInfo<Value>& args) {
-    Isolate *isolate = args.GetIsolate();
-    
+static void http_response_set_status(const FunctionCallbackInfo<Value>& args) {
     Local<Object> target = args[0] -> ToObject();
     NativeResource res = NativeResource::from_object(
         target
     );
-    assert(res.get_type() == NR_HttpRequest);
-    IceHttpRequest req = (IceHttpRequest) res.get_data();
+    assert(res.get_type() == NR_HttpResponse);
 
-    args.GetReturnValue().Set(
-        build_string_from_ice_owned_string(
-            isolate,
-            ice_http_request_get_method_to_owned(req)
-        )
-    );
+    IceHttpResponse resp = (IceHttpResponse) res.get_data();
+
+    ice_uint16_t status = args[1] -> NumberValue();
+    ice_http_response_set_status(resp, status);
 }
 
-static void http_request_get_remote_addr(const FunctionCallbackInfo<Value>& args) {
+static void http_response_set_header(const FunctionCallbackInfo<Value>& args) {
     Isolate *isolate = args.GetIsolate();
-    
+
     Local<Object> target = args[0] -> ToObject();
     NativeResource res = NativeResource::from_object(
         target
     );
-    assert(res.get_type() == NR_HttpRequest);
-    IceHttpRequest req = (IceHttpRequest) res.get_data();
+    assert(res.get_type() == NR_HttpResponse);
 
-    args.GetReturnValue().Set(
-        build_string_from_ice_owned_string(
-            isolate,
-            ice_http_request_get_remote_addr_to_owned(req)
-        )
-    );
+    IceHttpResponse resp = (IceHttpResponse) res.get_data();
+
+    InboundString key(isolate, args[1]);
+    InboundString value(isolate, args[2]);
+
+    ice_http_response_set_header(resp, *key, *value);
 }
 
-static void http_request_get_header(const FunctionCallbackInfo<Value>& args) {
+static void http_response_append_header(const FunctionCallbackInfo<Value>& args) {
     Isolate *isolate = args.GetIsolate();
-    
+
     Local<Object> target = args[0] -> ToObject();
     NativeResource res = NativeResource::from_object(
         target
     );
-    assert(res.get_type() == NR_HttpRequest);
-    IceHttpRequest req = (IceHttpRequest) res.get_data();
+    assert(res.get_type() == NR_HttpResponse);
 
-    String::Utf8Value key(args[1] -> ToString());
-    args.GetReturnValue().Set(
-        build_string_from_ice_owned_string(
-            isolate,
-            ice_http_request_get_header_to_owned(req, *key)
-        )
-    );
+    IceHttpResponse resp = (IceHttpResponse) res.get_data();
+
+    InboundString key(isolate, args[1]);
+    InboundString value(isolate, args[2]);
+
+    ice_http_response_append_header(resp, *key, *value);
 }
 
-struct RequestBodyReadContext {
-    std::unique_ptr<Persistent<Function>> onData;
-    std::unique_ptr<Persistent<Function>> onEnd;
-    bool shouldTerminate;
+static std::vector<ResponseHeader> response_header_scratch;
 
-    RequestBodyReadContext(Persistent<Function> *_onData, Persistent<Function> *_onEnd)
-        : onData(_onData), onEnd(_onEnd) {
-            shouldTerminate = false;
+static void collect_flat_headers(
+    Isolate *isolate,
+    Local<Value> headers,
+    std::vector<ResponseHeader>& out
+) {
+    if(!headers -> IsArray()) {
+        return;
     }
 
-    ~RequestBodyReadContext() {
-        onData -> Reset();
-        onEnd -> Reset();
+    Local<Array> kv = Local<Array>::Cast(headers);
+    unsigned int n_headers = kv -> Length() / 2;
+
+    for(unsigned int i = 0; i < n_headers; i++) {
+        InboundString key(isolate, kv -> Get(i * 2));
+        InboundString value(isolate, kv -> Get(i * 2 + 1));
+        out.push_back({ *key, *value, false });
     }
-};
+}
 
-static void http_request_take_and_read_body(const FunctionCallbackInfo<Value>& args) {
-    Isolate *isolate = args.GetIsolate();
-    
-    Local<Object> target = args[0] -> ToObject();
-    NativeResource res = NativeResource::from_object(
-        target
-    );
-    assert(res.get_type() == NR_HttpRequest);
-    IceHttpRequest req = (IceHttpRequest) res.get_data();
+static void collect_header_sets(Local<Value> sets, std::vector<ResponseHeader>& out) {
+    if(!sets -> IsArray()) {
+        return;
+    }
 
-    NativeResource::reset_object(target);
+    Local<Array> list = Local<Array>::Cast(sets);
+    unsigned int n_sets = list -> Length();
 
-    Local<Function> onData = Local<Function>::Cast(args[1]);
-    Local<Function> onEnd = Local<Function>::Cast(args[2]);
+    for(unsigned int i = 0; i < n_sets; i++) {
+        NativeResource res = NativeResource::from_object(list -> Get(i) -> ToObject());
+        assert(res.get_type() == NR_HttpHeaderSet);
 
-    auto callbackCtx = new RequestBodyReadContext(
-        new Persistent<Function>(isolate, onData),
-        new Persistent<Function>(isolate, onEnd)
-    );
+        for(auto& h : ((HttpHeaderSet *) res.get_data()) -> headers) {
+            out.push_back({ h.key, h.value, true });
+        }
+    }
+}
 
-    ice_http_request_take_and_read_body(
-        req,
-        [](const ice_uint8_t *data, ice_uint32_t len, void *call_with) -> ice_uint8_t {
-            auto callbackCtx = (RequestBodyReadContext *) call_with;
-            if(callbackCtx -> shouldTerminate) {
-                return 0;
+// The first occurrence of a header name replaces any existing value and
+// later ones are appended. Headers from a header set are skipped when the
+// response names the same header itself.
+static void emit_headers(IceHttpResponse resp, const std::vector<ResponseHeader>& headers) {
+    for(size_t i = 0; i < headers.size(); i++) {
+        const ResponseHeader& h = headers[i];
+        bool repeated = false;
+        bool overridden = false;
+
+        for(size_t j = 0; j < headers.size(); j++) {
+            if(j != i && strcasecmp(headers[j].key.c_str(), h.key.c_str()) == 0) {
+                if(h.from_set && !headers[j].from_set) {
+                    overridden = true;
+                    break;
+                }
+                if(j < i && headers[j].from_set == h.from_set) {
+                    repeated = true;
+                }
             }
+        }
 
-            char *raw_buf = new char [len];
-            memcpy(raw_buf, data, len);
-
-            enqueue_executor([=]() {
-                Isolate *isolate = Isolate::GetCurrent();
-                HandleScope scope(isolate);
+        if(overridden) {
+            continue;
+        }
+        if(repeated) {
+            ice_http_response_append_header(resp, h.key.c_str(), h.value.c_str());
+        } else {
+            ice_http_response_set_header(resp, h.key.c_str(), h.value.c_str());
+        }
+    }
+}
 
-                Local<Function> local_cb = Local<Function>::New(isolate, *callbackCtx -> onData);
-    
-                auto data_buf = node::Buffer::New(
-                    isolate,
-                    raw_buf,
-                    len,
-                    [](char *data, void *hint) {
-                        delete[] data;
-                    },
-                    NULL
-                );
-                assert(!data_buf.IsEmpty());
-    
-                Local<Value> argv[] = {
-                    data_buf.ToLocalChecked()
-                };
-    
-                Local<Value> ret = node::MakeCallback(
-                    isolate,
-                    Object::New(isolate),
-                    local_cb,
-                    1,
-                    argv
-                );
-                if(ret -> BooleanValue() == false) {
-                    callbackCtx -> shouldTerminate = true;
-                }
-            });
+// Applies status, a flat [k0, v0, k1, v1, ...] header list, a body
+// (Buffer, string, array of those, or null) and a list of header sets to
+// a response. A status of 0 leaves the status unchanged. Returns false,
+// with a TypeError pending, if a body part has an unsupported type.
+static bool apply_response_state(
+    Isolate *isolate,
+    IceHttpResponse resp,
+    Local<Value> status,
+    Local<Value> headers,
+    Local<Value> body,
+    Local<Value> header_sets
+) {
+    ice_uint16_t status_code = status -> NumberValue();
+    if(status_code) {
+        ice_http_response_set_status(resp, status_code);
+    }
 
-            return 1;
-        },
-        [](ice_uint8_t ok, void *call_with) {
-            enqueue_executor([=]() {
-                auto callbackCtx = (RequestBodyReadContext *) call_with;
+    response_header_scratch.clear();
+    collect_flat_headers(isolate, headers, response_header_scratch);
+    collect_header_sets(header_sets, response_header_scratch);
+    emit_headers(resp, response_header_scratch);
 
-                Isolate *isolate = Isolate::GetCurrent();
-                HandleScope scope(isolate);
-    
-                Local<Function> local_cb = Local<Function>::New(isolate, *callbackCtx -> onEnd);
-                Local<Value> argv[] = {
-                    Boolean::New(isolate, (bool) ok)
-                };
-                node::MakeCallback(
-                    isolate,
-                    Object::New(isolate),
-                    local_cb,
-                    1,
-                    argv
-                );
-    
-                delete callbackCtx;
-            });
-        },
-        (void *) callbackCtx
-    );
+    if(body -> IsArray()) {
+        if(!gather_body_parts(Local<Array>::Cast(body))) {
+            return false;
+        }
+        set_gathered_body(resp);
+    } else if(body -> IsString()) {
+        gather_body_part(body);
+        set_gathered_body(resp);
+    } else if(node::Buffer::HasInstance(body)) {
+        Local<Object> buf_obj = Local<Object>::Cast(body);
+        ice_http_response_set_body(
+            resp,
+            (const ice_uint8_t *) node::Buffer::Data(buf_obj),
+            node::Buffer::Length(buf_obj)
+        );
+    }
+    return true;
 }
 
-static void storage_file_http_response_begin_send(const FunctionCallbackInfo<Value>& args) {
-    Isolate *isolate = args.GetIsolate();
-    
-    Local<Object> arg0 = args[0] -> ToObject();
-    Local<Object> arg1 = args[1] -> ToObject();
-
-    NativeResource reqRes = NativeResource::from_object(
-        arg0
+static void http_response_apply(const FunctionCallbackInfo<Value>& args) {
+    Local<Object> target = args[0] -> ToObject();
+    NativeResource res = NativeResource::from_object(
+        target
     );
-    assert(reqRes.get_type() == NR_HttpRequest);
-    IceHttpRequest req = (IceHttpRequest) reqRes.get_data();
+    assert(res.get_type() == NR_HttpResponse);
 
-    NativeResource respRes = NativeResource::from_object(
-        arg1
+    apply_response_state(
+        args.GetIsolate(),
+        (IceHttpResponse) res.get_data(),
+        args[1],
+        args[2],
+        args[3],
+        args[4]
     );
-    assert(respRes.get_type() == NR_HttpResponse);
-    IceHttpResponse resp = (IceHttpResponse) respRes.get_data();
-
-    String::Utf8Value path(args[2] -> ToString());
-    ice_uint8_t ret = ice_storage_file_http_response_begin_send(req, resp, *path);
-    args.GetReturnValue().Set(Boolean::New(isolate, (bool) ret));
 }
 
-static void rpc_server_config_create(const FunctionCallbackInfo<Value>& args) {
-    NativeResource res(
-        NR_RpcServerConfig,
-        (void *) ice_rpc_server_config_create()
+// Builds and sends a complete response in one call:
+// http_respond(ctx, status, headersFlat, body, headerSets).
+static void http_respond(const FunctionCallbackInfo<Value>& args) {
+    Local<Object> ctx_obj = args[0] -> ToObject();
+    NativeResource ctxRes = NativeResource::from_object(
+        ctx_obj
     );
-    args.GetReturnValue().Set(res.build_object(args.GetIsolate()));
-}
+    assert(ctxRes.get_type() == NR_HttpEndpointContext);
 
-static void rpc_server_config_destroy(const FunctionCallbackInfo<Value>& args) {
-    Local<Object> arg0 = args[0] -> ToObject();
-    NativeResource res = NativeResource::from_object(
-        arg0
-    );
-    assert(res.get_type() == NR_RpcServerConfig);
+    IceHttpResponse resp = ice_http_response_create();
+    if(!apply_response_state(args.GetIsolate(), resp, args[1], args[2], args[3], args[4])) {
+        ice_http_response_destroy(resp);
+        return;
+    }
 
-    ice_rpc_server_config_destroy((IceRpcServerConfig) res.get_data());
-    NativeResource::reset_object(arg0);
+    ice_http_server_endpoint_context_end_with_response(
+        (IceHttpEndpointContext) ctxRes.get_data(),
+        resp
+    );
+    NativeResource::reset_object(ctx_obj);
 }
 
-static void rpc_server_config_add_method(const FunctionCallbackInfo<Value>& args) {
+static void http_header_set_create(const FunctionCallbackInfo<Value>& args) {
     Isolate *isolate = args.GetIsolate();
 
-    Local<Object> arg0 = args[0] -> ToObject();
-    NativeResource res = NativeResource::from_object(
-        arg0
-    );
-    assert(res.get_type() == NR_RpcServerConfig);
-
-    auto config = (IceRpcServerConfig) res.get_data();
-
-    String::Utf8Value name(args[1] -> ToString());
-
-    Local<Function> cb = Local<Function>::Cast(args[2]);
-    auto persistent_cb = new Persistent<Function>(isolate, cb);
-
-    ice_rpc_server_config_add_method(
-        config,
-        *name,
-        [](IceRpcCallContext ctx, void *call_with) {
-            enqueue_executor([=]() {
-                Isolate *isolate = Isolate::GetCurrent();
-                HandleScope scope(isolate);
-    
-                auto pf = (Persistent<Function> *) call_with;
-                auto cb = Local<Function>::New(isolate, *pf);
+    HttpHeaderSet *set = new HttpHeaderSet();
+    collect_flat_headers(isolate, args[0], set -> headers);
 
-                Local<Value> argv[] = {
-                    NativeResource(NR_RpcCallContext, (void *) ctx).build_object(isolate)
-                };
-                node::MakeCallback(
-                    isolate,
-                    Object::New(isolate),
-                    cb,
-                    1,
-                    argv
-                );
-            });
-        },
-        (void *) persistent_cb
+    args.GetReturnValue().Set(
+        NativeResource(NR_HttpHeaderSet, (void *) set).build_owned_object(isolate)
     );
 }
 
-static void rpc_server_create(const FunctionCallbackInfo<Value>& args) {
+// http_response_template_create(status, headersFlat, body, headerSets)
+static void http_response_template_create(const FunctionCallbackInfo<Value>& args) {
     Isolate *isolate = args.GetIsolate();
-    Local<Object> arg0 = args[0] -> ToObject();
-    NativeResource res = NativeResource::from_object(
-        arg0
-    );
-    assert(res.get_type() == NR_RpcServerConfig);
 
-    auto config = (IceRpcServerConfig) res.get_data();
-    NativeResource::reset_object(arg0);
+    HttpResponseTemplate *tmpl = new HttpResponseTemplate();
+    tmpl -> status = args[0] -> NumberValue();
+    collect_flat_headers(isolate, args[1], tmpl -> headers);
+    collect_header_sets(args[3], tmpl -> headers);
+
+    Local<Value> body = args[2];
+    if(body -> IsArray()) {
+        if(!gather_body_parts(Local<Array>::Cast(body))) {
+            delete tmpl;
+            return;
+        }
+    } else if(body -> IsString() || node::Buffer::HasInstance(body)) {
+        gather_body_part(body);
+    }
+    tmpl -> body.assign(body_gather_buffer.begin(), body_gather_buffer.end());
+    body_gather_buffer.clear();
 
-    IceRpcServer server = ice_rpc_server_create(config);
     args.GetReturnValue().Set(
-        NativeResource(
-            NR_RpcServer,
-            (void *) server
-        ).build_object(isolate)
+        NativeResource(NR_HttpResponseTemplate, (void *) tmpl).build_owned_object(isolate)
     );
 }
 
-static void rpc_server_start(const FunctionCallbackInfo<Value>& args) {
-    Local<Object> arg0 = args[0] -> ToObject();
-    NativeResource res = NativeResource::from_object(
-        arg0
+// Safe to call from executor threads.
+static void send_response_template(IceHttpEndpointContext ctx, const HttpResponseTemplate *tmpl) {
+    IceHttpResponse resp = ice_http_response_create();
+    if(tmpl -> status) {
+        ice_http_response_set_status(resp, tmpl -> status);
+    }
+    emit_headers(resp, tmpl -> headers);
+    ice_http_response_set_body(
+        resp,
+        (const ice_uint8_t *) tmpl -> body.data(),
+        tmpl -> body.size()
     );
-    assert(res.get_type() == NR_RpcServer);
-    auto server = (IceRpcServer) res.get_data();
 
-    String::Utf8Value addr(args[1] -> ToString());
-    ice_rpc_server_start(server, *addr);
+    ice_http_server_endpoint_context_end_with_response(ctx, resp);
 }
 
-static void rpc_call_context_get_num_params(const FunctionCallbackInfo<Value>& args) {
-    Isolate *isolate = args.GetIsolate();
-
-    Local<Object> arg0 = args[0] -> ToObject();
-    NativeResource res = NativeResource::from_object(
-        arg0
+static void http_respond_template(const FunctionCallbackInfo<Value>& args) {
+    Local<Object> ctx_obj = args[0] -> ToObject();
+    NativeResource ctxRes = NativeResource::from_object(
+        ctx_obj
     );
-    assert(res.get_type() == NR_RpcCallContext);
+    assert(ctxRes.get_type() == NR_HttpEndpointContext);
 
-    auto ctx = (IceRpcCallContext) res.get_data();
-    int n = ice_rpc_call_context_get_num_params(ctx);
+    NativeResource tmplRes = NativeResource::from_object(
+        args[1] -> ToObject()
+    );
+    assert(tmplRes.get_type() == NR_HttpResponseTemplate);
 
-    args.GetReturnValue().Set(
-        Number::New(isolate, n)
+    send_response_template(
+        (IceHttpEndpointContext) ctxRes.get_data(),
+        (HttpResponseTemplate *) tmplRes.get_data()
     );
+    NativeResource::reset_object(ctx_obj);
 }
 
-static void rpc_call_context_get_param(const FunctionCallbackInfo<Value>& args) {
-    Isolate *isolate = args.GetIsolate();
-
+// Bounded LRU cache of memory-mapped files, shared by all executor threads.
+// Entries are keyed by path and revalidated against the file's inode, size
+// and mtime on every use. Validators (ETag, Last-Modified) come from stat()
+// alone, so conditional requests are answered without touching file data.
+struct CachedFile {
+    std::string path;
+    void *data;
+    size_t size;
+    dev_t dev;
+    ino_t ino;
+    time_t mtime_sec;
+    long mtime_nsec;
+
+    CachedFile() {
+        data = NULL;
+        size = 0;
+    }
+
+    ~CachedFile() {
+        if(data) {
+            munmap(data, size);
+        }
+    }
+
+    bool matches(const struct stat& st) const {
+        return dev == st.st_dev
+            && ino == st.st_ino
+            && size == (size_t) st.st_size
+            && mtime_sec == st.st_mtim.tv_sec
+            && mtime_nsec == st.st_mtim.tv_nsec;
+    }
+};
+
+typedef std::list<std::shared_ptr<CachedFile>> FileCacheList;
+
+struct FileCache {
+    std::mutex lock;
+    FileCacheList lru;
+    std::unordered_map<std::string, FileCacheList::iterator> index;
+    size_t bytes;
+
+    std::atomic<size_t> max_bytes;
+    std::atomic<size_t> max_file_size;
+
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+    std::atomic<uint64_t> not_modified;
+    std::atomic<uint64_t> evictions;
+
+    FileCache() {
+        bytes = 0;
+        max_bytes = 0;
+        max_file_size = 0;
+        hits = 0;
+        misses = 0;
+        not_modified = 0;
+        evictions = 0;
+    }
+
+    // Called with the lock held.
+    void erase(FileCacheList::iterator it) {
+        bytes -= (*it) -> size;
+        index.erase((*it) -> path);
+        lru.erase(it);
+    }
+
+    void evict_to_fit() {
+        while(bytes > max_bytes && !lru.empty()) {
+            erase(std::prev(lru.end()));
+            evictions++;
+        }
+    }
+};
+
+static FileCache file_cache;
+
+static std::shared_ptr<CachedFile> map_file(const char *path, const struct stat& st) {
+    std::shared_ptr<CachedFile> entry(new CachedFile());
+    entry -> path = path;
+    entry -> size = st.st_size;
+    entry -> dev = st.st_dev;
+    entry -> ino = st.st_ino;
+    entry -> mtime_sec = st.st_mtim.tv_sec;
+    entry -> mtime_nsec = st.st_mtim.tv_nsec;
+
+    if(entry -> size) {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if(fd < 0) {
+            return NULL;
+        }
+
+        void *data = mmap(NULL, entry -> size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(data == MAP_FAILED) {
+            return NULL;
+        }
+        entry -> data = data;
+    }
+
+    return entry;
+}
+
+// Returns NULL if the file should not be served from the cache.
+static std::shared_ptr<CachedFile> file_cache_get(const char *path, const struct stat& st) {
+    if((size_t) st.st_size > file_cache.max_file_size || (size_t) st.st_size > file_cache.max_bytes) {
+        return NULL;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(file_cache.lock);
+
+        auto it = file_cache.index.find(path);
+        if(it != file_cache.index.end()) {
+            if((*it -> second) -> matches(st)) {
+                file_cache.lru.splice(file_cache.lru.begin(), file_cache.lru, it -> second);
+                file_cache.hits++;
+                return *it -> second;
+            }
+            file_cache.erase(it -> second);
+        }
+    }
+
+    file_cache.misses++;
+
+    std::shared_ptr<CachedFile> entry = map_file(path, st);
+    if(!entry) {
+        return NULL;
+    }
+
+    std::lock_guard<std::mutex> lock(file_cache.lock);
+
+    auto it = file_cache.index.find(path);
+    if(it != file_cache.index.end()) {
+        file_cache.erase(it -> second);
+    }
+
+    file_cache.lru.push_front(entry);
+    file_cache.index[entry -> path] = file_cache.lru.begin();
+    file_cache.bytes += entry -> size;
+    file_cache.evict_to_fit();
+
+    return entry;
+}
+
+// Whether an If-None-Match list names `etag` (a quoted strong tag) or is
+// "*". Tags are compared exactly after dropping any W/ prefix, as
+// If-None-Match uses weak comparison.
+static bool etag_list_matches(const char *list, const char *etag) {
+    size_t etag_len = strlen(etag);
+    const char *p = list;
+
+    while(*p) {
+        while(*p == ' ' || *p == '\t' || *p == ',') p++;
+        if(!*p) {
+            break;
+        }
+
+        if(*p == '*') {
+            return true;
+        }
+        if(p[0] == 'W' && p[1] == '/') {
+            p += 2;
+        }
+
+        // Quoted tags may contain commas, so they end at the closing quote.
+        const char *end;
+        if(*p == '"') {
+            end = strchr(p + 1, '"');
+            end = end ? end + 1 : p + strlen(p);
+        } else {
+            end = p + strcspn(p, ",");
+        }
+
+        if((size_t) (end - p) == etag_len && memcmp(p, etag, etag_len) == 0) {
+            return true;
+        }
+        p = end;
+        while(*p && *p != ',') p++;
+    }
+    return false;
+}
+
+static bool request_is_not_modified(IceHttpRequest req, const char *etag, time_t mtime) {
+    ice_owned_string_t if_none_match = ice_http_request_get_header_to_owned(req, "If-None-Match");
+    if(if_none_match) {
+        bool ret = etag_list_matches(if_none_match, etag);
+        ice_glue_destroy_cstring(if_none_match);
+        return ret;
+    }
+
+    ice_owned_string_t if_modified_since = ice_http_request_get_header_to_owned(req, "If-Modified-Since");
+    if(if_modified_since) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+
+        bool ret = false;
+        if(strptime(if_modified_since, "%a, %d %b %Y %H:%M:%S GMT", &tm)) {
+            ret = mtime <= timegm(&tm);
+        }
+        ice_glue_destroy_cstring(if_modified_since);
+        return ret;
+    }
+
+    return false;
+}
+
+// Fills resp with the file at path. Goes through the file cache when it is
+// enabled, and otherwise (or for files the cache does not take) lets the
+// core send the file.
+static bool send_file(IceHttpRequest req, IceHttpResponse resp, const char *path) {
+    struct stat st;
+    if(file_cache.max_bytes == 0 || stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return ice_storage_file_http_response_begin_send(req, resp, path);
+    }
+
+    char etag[96];
+    snprintf(
+        etag,
+        sizeof(etag),
+        "\"%llx-%llx-%llx.%lx\"",
+        (unsigned long long) st.st_ino,
+        (unsigned long long) st.st_size,
+        (unsigned long long) st.st_mtim.tv_sec,
+        (unsigned long) st.st_mtim.tv_nsec
+    );
+
+    char last_modified[64];
+    struct tm tm;
+    gmtime_r(&st.st_mtim.tv_sec, &tm);
+    strftime(last_modified, sizeof(last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+    if(request_is_not_modified(req, etag, st.st_mtim.tv_sec)) {
+        file_cache.not_modified++;
+        ice_http_response_set_status(resp, 304);
+        ice_http_response_set_header(resp, "ETag", etag);
+        ice_http_response_set_header(resp, "Last-Modified", last_modified);
+        return true;
+    }
+
+    std::shared_ptr<CachedFile> entry = file_cache_get(path, st);
+    if(!entry) {
+        return ice_storage_file_http_response_begin_send(req, resp, path);
+    }
+
+    ice_http_response_set_header(resp, "ETag", etag);
+    ice_http_response_set_header(resp, "Last-Modified", last_modified);
+    ice_http_response_set_body(resp, (const ice_uint8_t *) entry -> data, entry -> size);
+    return true;
+}
+
+// Native request router. Routes are kept in a tree keyed on path
+// segments; each node has a table of handlers by method. A segment of the
+// form ":name" captures one path segment, and "*name" (or "*") as the last
+// segment captures the rest of the path. Matching and 404/405 responses
+// happen on the executor thread, so JS only sees requests it handles.
+
+typedef std::vector<std::pair<std::string, std::string>> RouteParams;
+
+enum RouteHandlerKind {
+    RH_JsCallback,
+    RH_Template,
+    RH_File,
+    RH_Directory
+};
+
+// Everything but RH_JsCallback is answered on the executor thread.
+struct RouteHandler {
+    std::string method;
+    RouteHandlerKind kind;
+    Persistent<Function> *cb;
+    std::shared_ptr<HttpResponseTemplate> tmpl;
+    std::string file_path;
+};
+
+// A path segment that points into a request URI or a node's own copy, so
+// child lookups do not allocate.
+struct SegmentKey {
+    const char *data;
+    size_t len;
+};
+
+struct SegmentKeyHash {
+    size_t operator()(const SegmentKey& k) const {
+        size_t h = 14695981039346656037ULL;
+        for(size_t i = 0; i < k.len; i++) {
+            h = (h ^ (unsigned char) k.data[i]) * 1099511628211ULL;
+        }
+        return h;
+    }
+};
+
+struct SegmentKeyEqual {
+    bool operator()(const SegmentKey& a, const SegmentKey& b) const {
+        return a.len == b.len && memcmp(a.data, b.data, a.len) == 0;
+    }
+};
+
+struct RouterNode {
+    // Keys point to the child's `segment`.
+    std::unordered_map<SegmentKey, RouterNode *, SegmentKeyHash, SegmentKeyEqual> children;
+    std::string segment;
+    RouterNode *param_child;
+    RouterNode *wildcard_child;
+    std::string capture_name;
+    std::vector<RouteHandler> handlers;
+
+    RouterNode() {
+        param_child = NULL;
+        wildcard_child = NULL;
+    }
+
+    ~RouterNode() {
+        for(auto& it : children) {
+            delete it.second;
+        }
+        delete param_child;
+        delete wildcard_child;
+    }
+
+    const RouteHandler * find_handler(const char *method) const {
+        for(auto& h : handlers) {
+            if(h.method == method) {
+                return &h;
+            }
+        }
+        return NULL;
+    }
+};
+
+struct HttpRouter {
+    RouterNode root;
+    std::vector<std::string> fallback_prefixes;
+    Persistent<Function> *fallback;
+    std::vector<Persistent<Function> *> callbacks;
+
+    HttpRouter() {
+        fallback = NULL;
+    }
+
+    ~HttpRouter() {
+        for(auto cb : callbacks) {
+            release_persistent_function(cb);
+        }
+    }
+};
+
+static void http_router_destroy(HttpRouter *router) {
+    delete router;
+}
+
+// Only allocated for requests dispatched to JS.
+struct HttpRouteMatch {
+    Persistent<Function> *cb;
+    IceHttpEndpointContext ctx;
+    IceHttpRequest req;
+    ice_owned_string_t method;
+    ice_owned_string_t uri;
+    RouteParams params;
+
+    // For requests passed to the fallback: the status they would have
+    // been answered with natively, and the methods allowed for a 405.
+    int unmatched_status;
+    std::string allow;
+};
+
+static const int ROUTER_MAX_SEGMENTS = 32;
+
+// Parameters captured while matching, pointing into the request URI.
+struct RouteCaptures {
+    const RouterNode *node[ROUTER_MAX_SEGMENTS];
+    const char *start[ROUTER_MAX_SEGMENTS];
+    size_t len[ROUTER_MAX_SEGMENTS];
+    int count;
+};
+
+struct PathSegments {
+    const char *start[ROUTER_MAX_SEGMENTS];
+    size_t len[ROUTER_MAX_SEGMENTS];
+    int count;
+    const char *end;
+};
+
+// Splits "/a/b/c" into "a", "b", "c". Returns false if there are too
+// many segments to route.
+static bool split_path(const char *path, size_t path_len, PathSegments& segs) {
+    const char *p = path;
+    const char *end = path + path_len;
+    if(p < end && *p == '/') p++;
+
+    segs.count = 0;
+    segs.end = end;
+
+    while(true) {
+        if(segs.count == ROUTER_MAX_SEGMENTS) {
+            return false;
+        }
+
+        const char *sep = (const char *) memchr(p, '/', end - p);
+        if(!sep) sep = end;
+
+        segs.start[segs.count] = p;
+        segs.len[segs.count] = sep - p;
+        segs.count++;
+
+        if(sep == end) {
+            return true;
+        }
+        p = sep + 1;
+    }
+}
+
+// Finds the node with a handler for `method`, backtracking from static to parameter to wildcard segments.
+static RouterNode * router_match(RouterNode *node, const PathSegments& segs, int i, const char *method, RouteCaptures& caps) {
+    if(i == segs.count) {
+        return node -> find_handler(method) ? node : NULL;
+    }
+
+    if(!node -> children.empty()) {
+        auto it = node -> children.find(SegmentKey { segs.start[i], segs.len[i] });
+        if(it != node -> children.end()) {
+            RouterNode *ret = router_match(it -> second, segs, i + 1, method, caps);
+            if(ret) return ret;
+        }
+    }
+
+    if(node -> param_child && segs.len[i]) {
+        int n = caps.count++;
+        caps.node[n] = node -> param_child;
+        caps.start[n] = segs.start[i];
+        caps.len[n] = segs.len[i];
+
+        RouterNode *ret = router_match(node -> param_child, segs, i + 1, method, caps);
+        if(ret) return ret;
+        caps.count = n;
+    }
+
+    if(node -> wildcard_child && node -> wildcard_child -> find_handler(method)) {
+        int n = caps.count++;
+        caps.node[n] = node -> wildcard_child;
+        caps.start[n] = segs.start[i];
+        caps.len[n] = segs.end - segs.start[i];
+        return node -> wildcard_child;
+    }
+
+    return NULL;
+}
+
+static void respond_natively(IceHttpEndpointContext ctx, ice_uint16_t status, const char *body, const char *allow) {
+    IceHttpResponse resp = ice_http_response_create();
+    ice_http_response_set_status(resp, status);
+    ice_http_response_set_header(resp, "X-Powered-By", "Ice-node");
+    if(allow) {
+        ice_http_response_set_header(resp, "Allow", allow);
+    }
+    ice_http_response_set_body(resp, (const ice_uint8_t *) body, strlen(body));
+    ice_http_server_endpoint_context_end_with_response(ctx, resp);
+}
+
+static void send_file_natively(IceHttpEndpointContext ctx, IceHttpRequest req, const char *path) {
+    IceHttpResponse resp = ice_http_response_create();
+    ice_http_response_set_header(resp, "X-Powered-By", "Ice-node");
+
+    if(!send_file(req, resp, path)) {
+        ice_http_response_destroy(resp);
+        respond_natively(ctx, 404, "Not found\n", NULL);
+        return;
+    }
+    ice_http_server_endpoint_context_end_with_response(ctx, resp);
+}
+
+// A relative path taken from the request is only served if none of its
+// segments could step outside the directory.
+static bool is_safe_relative_path(const std::string& path) {
+    if(path.empty() || path[0] == '/' || path.find('\\') != std::string::npos || path.find('\0') != std::string::npos) {
+        return false;
+    }
+
+    size_t start = 0;
+    while(start <= path.size()) {
+        size_t end = path.find('/', start);
+        if(end == std::string::npos) end = path.size();
+
+        std::string seg = path.substr(start, end - start);
+        if(seg == ".." || seg == "." || seg.find('%') != std::string::npos) {
+            return false;
+        }
+        start = end + 1;
+    }
+    return true;
+}
+
+static void handle_natively(
+    IceHttpEndpointContext ctx,
+    IceHttpRequest req,
+    const RouteHandler *handler,
+    const RouteCaptures& caps
+) {
+    switch(handler -> kind) {
+        case RH_Template:
+            send_response_template(ctx, handler -> tmpl.get());
+            break;
+
+        case RH_File:
+            send_file_natively(ctx, req, handler -> file_path.c_str());
+            break;
+
+        case RH_Directory: {
+            std::string rest;
+            if(caps.count) {
+                rest.assign(caps.start[caps.count - 1], caps.len[caps.count - 1]);
+            }
+
+            // Symlinks inside the directory must not lead out of it.
+            char resolved[PATH_MAX];
+            const std::string& root = handler -> file_path;
+            if(
+                !is_safe_relative_path(rest)
+                || !realpath((root + "/" + rest).c_str(), resolved)
+                || strncmp(resolved, root.c_str(), root.size()) != 0
+                || (root.size() > 1 && resolved[root.size()] != '/')
+            ) {
+                respond_natively(ctx, 404, "Not found\n", NULL);
+            } else {
+                send_file_natively(ctx, req, resolved);
+            }
+            break;
+        }
+
+        default:
+            assert(false);
+    }
+}
+
+// Collects the methods of every node matching the path, for the Allow
+// header of a 405.
+static void router_collect_allowed(const RouterNode *node, const PathSegments& segs, int i, std::vector<const std::string *>& allowed) {
+    const RouterNode *matched = NULL;
+
+    if(i == segs.count) {
+        matched = node;
+    } else {
+        if(!node -> children.empty()) {
+            auto it = node -> children.find(SegmentKey { segs.start[i], segs.len[i] });
+            if(it != node -> children.end()) {
+                router_collect_allowed(it -> second, segs, i + 1, allowed);
+            }
+        }
+        if(node -> param_child && segs.len[i]) {
+            router_collect_allowed(node -> param_child, segs, i + 1, allowed);
+        }
+        matched = node -> wildcard_child;
+    }
+
+    if(!matched) {
+        return;
+    }
+    for(auto& h : matched -> handlers) {
+        bool seen = false;
+        for(auto m : allowed) {
+            if(*m == h.method) seen = true;
+        }
+        if(!seen) allowed.push_back(&h.method);
+    }
+}
+
+static std::string router_allowed_methods(const std::vector<const std::string *>& allowed) {
+    std::string allow;
+    for(auto m : allowed) {
+        if(!allow.empty()) allow += ", ";
+        allow += *m;
+    }
+    return allow;
+}
+
+// Runs on an executor thread.
+static void route_request(HttpRouter *router, IceHttpEndpointContext ctx, IceHttpRequest req) {
+    ice_owned_string_t uri = ice_http_request_get_uri_to_owned(req);
+    ice_owned_string_t method = ice_http_request_get_method_to_owned(req);
+    assert(uri && method);
+
+    size_t path_len = strcspn(uri, "?");
+    RouterNode *node = NULL;
+    const RouteHandler *handler = NULL;
+
+    // Methods allowed for the path, if no handler matches the method.
+    std::vector<const std::string *> allowed;
+
+    PathSegments segs;
+    RouteCaptures caps;
+    caps.count = 0;
+
+    if(split_path(uri, path_len, segs)) {
+        node = router_match(&router -> root, segs, 0, method, caps);
+        if(node) {
+            handler = node -> find_handler(method);
+        } else {
+            router_collect_allowed(&router -> root, segs, 0, allowed);
+        }
+    }
+
+    if(handler && handler -> kind != RH_JsCallback) {
+        handle_natively(ctx, req, handler, caps);
+
+        ice_glue_destroy_cstring(uri);
+        ice_glue_destroy_cstring(method);
+        return;
+    }
+
+    Persistent<Function> *cb = NULL;
+
+    if(handler) {
+        cb = handler -> cb;
+    } else if(router -> fallback) {
+        for(auto& prefix : router -> fallback_prefixes) {
+            if(path_len >= prefix.size() && memcmp(uri, prefix.data(), prefix.size()) == 0) {
+                cb = router -> fallback;
+                break;
+            }
+        }
+    }
+
+    if(!cb) {
+        ice_glue_destroy_cstring(uri);
+        ice_glue_destroy_cstring(method);
+
+        if(!allowed.empty()) {
+            respond_natively(ctx, 405, "", router_allowed_methods(allowed).c_str());
+        } else {
+            respond_natively(ctx, 404, "Not found\n", NULL);
+        }
+        return;
+    }
+
+    HttpRouteMatch *m = new HttpRouteMatch();
+    m -> cb = cb;
+    m -> ctx = ctx;
+    m -> req = req;
+    m -> method = method;
+    m -> uri = uri;
+
+    if(handler) {
+        m -> unmatched_status = 0;
+        m -> params.reserve(caps.count);
+        for(int i = 0; i < caps.count; i++) {
+            m -> params.emplace_back(caps.node[i] -> capture_name, std::string(caps.start[i], caps.len[i]));
+        }
+    } else if(!allowed.empty()) {
+        m -> unmatched_status = 405;
+        m -> allow = router_allowed_methods(allowed);
+    } else {
+        m -> unmatched_status = 404;
+    }
+
+    enqueue_event(AE_HttpRouterMatch, (void *) m, NULL, NULL, 0);
+}
+
+static void dispatch_http_router_match(AsyncEvent *ev) {
+    HttpRouteMatch *m = (HttpRouteMatch *) ev -> p0;
+
+    Isolate *isolate = Isolate::GetCurrent();
+    HandleScope scope(isolate);
+
+    Local<Function> local_cb = Local<Function>::New(isolate, *m -> cb);
+
+    Local<Object> params = Object::New(isolate);
+    for(auto& kv : m -> params) {
+        params -> Set(
+            build_string_from_native(isolate, kv.first.data(), kv.first.size()),
+            build_string_from_native(isolate, kv.second.data(), kv.second.size())
+        );
+    }
+
+    Local<Value> argv[] = {
+        NativeResource(NR_HttpEndpointContext, (void *) m -> ctx).build_object(isolate),
+        NativeResource(NR_HttpRequest, (void *) m -> req).build_object(isolate),
+        build_method_string_from_ice_owned_string(isolate, m -> method),
+        build_string_from_ice_owned_string(isolate, m -> uri),
+        build_string_from_ice_owned_string(isolate, ice_http_request_get_remote_addr_to_owned(m -> req)),
+        params,
+        Integer::New(isolate, m -> unmatched_status),
+        build_string_from_native(isolate, m -> allow.data(), m -> allow.size())
+    };
+    delete m;
+
+    invoke_callback(
+        isolate,
+        local_cb,
+        8,
+        argv
+    );
+}
+
+static HttpRouter * router_from_object(Local<Object> target) {
+    NativeResource res = NativeResource::from_object(target);
+    assert(res.get_type() == NR_HttpRouter);
+    return (HttpRouter *) res.get_data();
+}
+
+static void http_router_create(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+
+    args.GetReturnValue().Set(
+        NativeResource(NR_HttpRouter, (void *) new HttpRouter()).build_owned_object(isolate)
+    );
+}
+
+// Returns the node for a route pattern, creating it if needed.
+static RouterNode * router_insert(RouterNode *node, const PathSegments& segs) {
+    for(int i = 0; i < segs.count; i++) {
+        std::string seg(segs.start[i], segs.len[i]);
+
+        if(seg.size() && seg[0] == ':') {
+            if(!node -> param_child) {
+                node -> param_child = new RouterNode();
+                node -> param_child -> capture_name = seg.substr(1);
+            }
+            node = node -> param_child;
+        } else if(seg.size() && seg[0] == '*') {
+            if(i != segs.count - 1) {
+                return NULL;
+            }
+            if(!node -> wildcard_child) {
+                node -> wildcard_child = new RouterNode();
+                node -> wildcard_child -> capture_name = seg.size() > 1 ? seg.substr(1) : "*";
+            }
+            node = node -> wildcard_child;
+        } else {
+            auto it = node -> children.find(SegmentKey { seg.data(), seg.size() });
+            if(it == node -> children.end()) {
+                RouterNode *child = new RouterNode();
+                child -> segment = seg;
+                it = node -> children.emplace(SegmentKey { child -> segment.data(), child -> segment.size() }, child).first;
+            }
+            node = it -> second;
+        }
+    }
+    return node;
+}
+
+// Adds or replaces the handler for handler.method at a path pattern.
+// Returns false if the pattern is invalid.
+static bool router_add_handler(HttpRouter *router, const char *path, RouteHandler handler) {
+    PathSegments segs;
+    RouterNode *node = NULL;
+    if(split_path(path, strlen(path), segs)) {
+        node = router_insert(&router -> root, segs);
+    }
+    if(!node) {
+        return false;
+    }
+    if(handler.kind == RH_Directory && node == &router -> root) {
+        return false;
+    }
+
+    for(auto& h : node -> handlers) {
+        if(h.method == handler.method) {
+            h = handler;
+            return true;
+        }
+    }
+    node -> handlers.push_back(handler);
+    return true;
+}
+
+// http_router_add(router, method, path, cb)
+static void http_router_add(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+    HttpRouter *router = router_from_object(args[0] -> ToObject());
+
+    InboundString method(isolate, args[1]);
+    InboundString path(isolate, args[2]);
+    Local<Function> cb = Local<Function>::Cast(args[3]);
+
+    auto persistent_cb = new Persistent<Function>(isolate, cb);
+    router -> callbacks.push_back(persistent_cb);
+
+    RouteHandler handler;
+    handler.method = *method;
+    handler.kind = RH_JsCallback;
+    handler.cb = persistent_cb;
+
+    args.GetReturnValue().Set(router_add_handler(router, *path, handler));
+}
+
+// http_router_add_template(router, method, path, template). The template
+// is copied, so it may be released afterwards.
+static void http_router_add_template(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+    HttpRouter *router = router_from_object(args[0] -> ToObject());
+
+    InboundString method(isolate, args[1]);
+    InboundString path(isolate, args[2]);
+
+    NativeResource tmplRes = NativeResource::from_object(args[3] -> ToObject());
+    assert(tmplRes.get_type() == NR_HttpResponseTemplate);
+
+    RouteHandler handler;
+    handler.method = *method;
+    handler.kind = RH_Template;
+    handler.cb = NULL;
+    handler.tmpl.reset(new HttpResponseTemplate(*(HttpResponseTemplate *) tmplRes.get_data()));
+
+    args.GetReturnValue().Set(router_add_handler(router, *path, handler));
+}
+
+// http_router_add_redirect(router, method, path, location, status)
+static void http_router_add_redirect(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+    HttpRouter *router = router_from_object(args[0] -> ToObject());
+
+    InboundString method(isolate, args[1]);
+    InboundString path(isolate, args[2]);
+    InboundString location(isolate, args[3]);
+
+    RouteHandler handler;
+    handler.method = *method;
+    handler.kind = RH_Template;
+    handler.cb = NULL;
+    handler.tmpl.reset(new HttpResponseTemplate());
+    handler.tmpl -> status = args[4] -> NumberValue();
+    handler.tmpl -> headers.push_back({ "X-Powered-By", "Ice-node", false });
+    handler.tmpl -> headers.push_back({ "Location", *location, false });
+
+    args.GetReturnValue().Set(router_add_handler(router, *path, handler));
+}
+
+// http_router_add_file(router, method, path, filePath)
+static void http_router_add_file(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+    HttpRouter *router = router_from_object(args[0] -> ToObject());
+
+    InboundString method(isolate, args[1]);
+    InboundString path(isolate, args[2]);
+    InboundString file_path(isolate, args[3]);
+
+    RouteHandler handler;
+    handler.method = *method;
+    handler.kind = RH_File;
+    handler.cb = NULL;
+    handler.file_path = *file_path;
+
+    args.GetReturnValue().Set(router_add_handler(router, *path, handler));
+}
+
+// http_router_add_directory(router, method, path, dirPath). The path must
+// end with a wildcard segment, which selects the file under dirPath.
+static void http_router_add_directory(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+    HttpRouter *router = router_from_object(args[0] -> ToObject());
+
+    InboundString method(isolate, args[1]);
+    InboundString path(isolate, args[2]);
+    InboundString dir_path(isolate, args[3]);
+
+    const char *last_sep = strrchr(*path, '/');
+    if(!last_sep || last_sep[1] != '*') {
+        args.GetReturnValue().Set(false);
+        return;
+    }
+
+    // Requests are checked against the resolved directory.
+    char resolved[PATH_MAX];
+    if(!realpath(*dir_path, resolved)) {
+        isolate -> ThrowException(Exception::Error(
+            String::NewFromUtf8(isolate, (std::string("Unable to resolve directory: ") + *dir_path).c_str())
+        ));
+        return;
+    }
+
+    RouteHandler handler;
+    handler.method = *method;
+    handler.kind = RH_Directory;
+    handler.cb = NULL;
+    handler.file_path = resolved;
+
+    args.GetReturnValue().Set(router_add_handler(router, *path, handler));
+}
+
+// Requests that match no route but start with one of these prefixes are
+// passed to the fallback callback instead of getting a native 404/405.
+static void http_router_add_fallback_prefix(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+    HttpRouter *router = router_from_object(args[0] -> ToObject());
+
+    InboundString prefix(isolate, args[1]);
+    router -> fallback_prefixes.push_back(*prefix);
+}
+
+static void http_router_set_fallback(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+    HttpRouter *router = router_from_object(args[0] -> ToObject());
+
+    auto persistent_cb = new Persistent<Function>(isolate, Local<Function>::Cast(args[1]));
+    router -> callbacks.push_back(persistent_cb);
+    router -> fallback = persistent_cb;
+}
+
+// Installs the router as the server's default route. The router is owned
+// by the server from then on.
+static void http_server_set_router(const FunctionCallbackInfo<Value>& args) {
+    auto arg0 = args[0] -> ToObject();
+    auto arg1 = args[1] -> ToObject();
+
+    NativeResource serverRes = NativeResource::from_object(arg0);
+    assert(serverRes.get_type() == NR_HttpServer);
+
+    HttpRouter *router = router_from_object(arg1);
+
+    IceHttpRouteInfo rt = ice_http_server_route_create(
+        "",
+        [](IceHttpEndpointContext ctx, IceHttpRequest req, void *call_with) {
+            route_request((HttpRouter *) call_with, ctx, req);
+        },
+        (void *) router
+    );
+    ice_http_server_set_default_route((IceHttpServer) serverRes.get_data(), rt);
+
+    NativeResource::reset_object(arg1);
+}
+
+static void http_request_destroy(const FunctionCallbackInfo<Value>& args) {
+    Local<Object> target = args[0] -> ToObject();
+    NativeResource res = NativeResource::from_object(
+        target
+    );
+    assert(res.get_type() == NR_HttpRequest);
+    IceHttpRequest req = (IceHttpRequest) res.get_data();
+
+    ice_http_request_destroy(req);
+    NativeResource::reset_object(target);
+}
+
+static void http_request_get_uri(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+
+    Local<Object> target = args[0] -> ToObject();
+    NativeResource res = NativeResource::from_object(
+        target
+    );
+    assert(res.get_type() == NR_HttpRequest);
+    IceHttpRequest req = (IceHttpRequest) res.get_data();
+
+    args.GetReturnValue().Set(
+        build_string_from_ice_owned_string(
+            isolate,
+            ice_http_request_get_uri_to_owned(req)
+        )
+    );
+}
+
+static void http_request_get_method(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+    
+    Local<Object> target = args[0] -> ToObject();
+    NativeResource res = NativeResource::from_object(
+        target
+    );
+    assert(res.get_type() == NR_HttpRequest);
+    IceHttpRequest req = (IceHttpRequest) res.get_data();
+
+    args.GetReturnValue().Set(
+        build_method_string_from_ice_owned_string(
+            isolate,
+            ice_http_request_get_method_to_owned(req)
+        )
+    );
+}
+
+static void http_request_get_remote_addr(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+    
+    Local<Object> target = args[0] -> ToObject();
+    NativeResource res = NativeResource::from_object(
+        target
+    );
+    assert(res.get_type() == NR_HttpRequest);
+    IceHttpRequest req = (IceHttpRequest) res.get_data();
+
+    args.GetReturnValue().Set(
+        build_string_from_ice_owned_string(
+            isolate,
+            ice_http_request_get_remote_addr_to_owned(req)
+        )
+    );
+}
+
+static void http_request_get_header(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+    
+    Local<Object> target = args[0] -> ToObject();
+    NativeResource res = NativeResource::from_object(
+        target
+    );
+    assert(res.get_type() == NR_HttpRequest);
+    IceHttpRequest req = (IceHttpRequest) res.get_data();
+
+    InboundString key(isolate, args[1]);
+    args.GetReturnValue().Set(
+        build_string_from_ice_owned_string(
+            isolate,
+            ice_http_request_get_header_to_owned(req, *key)
+        )
+    );
+}
+
+static void http_request_get_headers(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+
+    Local<Object> target = args[0] -> ToObject();
+    NativeResource res = NativeResource::from_object(
+        target
+    );
+    assert(res.get_type() == NR_HttpRequest);
+    IceHttpRequest req = (IceHttpRequest) res.get_data();
+
+    Local<Array> keys = Local<Array>::Cast(args[1]);
+    unsigned int n_keys = keys -> Length();
+    Local<Array> values = Array::New(isolate, n_keys);
+
+    for(unsigned int i = 0; i < n_keys; i++) {
+        InboundString key(isolate, keys -> Get(i));
+        values -> Set(
+            i,
+            build_string_from_ice_owned_string(
+                isolate,
+                ice_http_request_get_header_to_owned(req, *key)
+            )
+        );
+    }
+
+    args.GetReturnValue().Set(values);
+}
+
+static const ice_uint32_t BODY_CHUNK_CAPACITY = 16384 - 64;
+static const ice_uint32_t BODY_CHUNK_SEALED = 0x80000000;
+
+// Pooled buffer for request body data. Chunks that arrive before the JS
+// thread has picked up the previous one are appended to it, so that they
+// reach JS as a single Buffer.
+struct BodyChunk {
+    BodyChunk *next;
+
+    // Committed length. BODY_CHUNK_SEALED is set when the JS thread takes
+    // the chunk; nothing may be appended after that.
+    std::atomic<ice_uint32_t> state;
+
+    // Held by the reader while it may still append, and by the Buffer
+    // handed to JS.
+    std::atomic<int> refs;
+
+    char data[BODY_CHUNK_CAPACITY];
+};
+
+typedef NodePool<BodyChunk, 16> BodyChunkPool;
+
+static void body_chunk_unref(BodyChunk *chunk) {
+    if(chunk -> refs.fetch_sub(1) == 1) {
+        BodyChunkPool::release(chunk, chunk);
+    }
+}
+
+// Data that arrived while delivery was held, kept on the JS thread.
+struct HeldBodyData {
+    BodyChunk *chunk;
+    size_t len;
+};
+
+// Shared between the reader (an ice executor thread) and the JS thread.
+// The core gives no way to stop reading the socket short of blocking an
+// executor, so the reader never waits: data keeps being queued for JS, and
+// holding only delays delivery on the JS thread. Memory is unbounded unless
+// max_buffered is set, in which case the read is terminated once more than
+// that many bytes are queued.
+struct RequestBodyReadContext {
+    std::unique_ptr<Persistent<Function>> onData;
+    std::unique_ptr<Persistent<Function>> onEnd;
+    std::atomic<bool> shouldTerminate;
+
+    // Last chunk queued for JS; only touched by the reader thread.
+    BodyChunk *open_chunk;
+
+    size_t max_buffered;
+    std::atomic<size_t> inflight_bytes;
+
+    // Only touched on the JS thread.
+    bool holding;
+    bool draining;
+    std::deque<HeldBodyData> held;
+    bool end_pending;
+    bool end_ok;
+
+    // Held by the read itself until onEnd has run, and by the JS stream
+    // handle. Only changed on the JS thread.
+    int refs;
+
+    RequestBodyReadContext(Persistent<Function> *_onData, Persistent<Function> *_onEnd, size_t _max_buffered)
+        : onData(_onData), onEnd(_onEnd) {
+            shouldTerminate = false;
+            open_chunk = NULL;
+            max_buffered = _max_buffered;
+            inflight_bytes = 0;
+            holding = false;
+            draining = false;
+            end_pending = false;
+            end_ok = false;
+            refs = 2;
+    }
+
+    ~RequestBodyReadContext() {
+        onData -> Reset();
+        onEnd -> Reset();
+    }
+};
+
+static void body_read_context_unref(RequestBodyReadContext *callbackCtx) {
+    if(--callbackCtx -> refs == 0) {
+        delete callbackCtx;
+    }
+}
+
+static bool append_to_open_body_chunk(RequestBodyReadContext *callbackCtx, const ice_uint8_t *data, ice_uint32_t len) {
+    BodyChunk *chunk = callbackCtx -> open_chunk;
+    if(chunk == NULL) {
+        return false;
+    }
+
+    ice_uint32_t committed = chunk -> state.load();
+    if((committed & BODY_CHUNK_SEALED) || committed + len > BODY_CHUNK_CAPACITY) {
+        return false;
+    }
+
+    // The JS thread never reads past the committed length, so the copy can
+    // happen before publishing it. If the chunk got sealed in the meantime
+    // the copied bytes are simply ignored.
+    memcpy(chunk -> data + committed, data, len);
+    return chunk -> state.compare_exchange_strong(committed, committed + len);
+}
+
+static void close_open_body_chunk(RequestBodyReadContext *callbackCtx) {
+    if(callbackCtx -> open_chunk) {
+        body_chunk_unref(callbackCtx -> open_chunk);
+        callbackCtx -> open_chunk = NULL;
+    }
+}
+
+// Data larger than a chunk is split across several, so that large reads
+// are pooled too. Only the last chunk is left open for appending.
+static void enqueue_body_data(RequestBodyReadContext *callbackCtx, const ice_uint8_t *data, ice_uint32_t len) {
+    if(append_to_open_body_chunk(callbackCtx, data, len)) {
+        return;
+    }
+    close_open_body_chunk(callbackCtx);
+
+    while(len > 0) {
+        ice_uint32_t n = std::min(len, BODY_CHUNK_CAPACITY);
+
+        BodyChunk *chunk = BodyChunkPool::alloc();
+        memcpy(chunk -> data, data, n);
+        chunk -> state.store(n);
+
+        data += n;
+        len -= n;
+
+        if(len == 0) {
+            chunk -> refs.store(2);
+            callbackCtx -> open_chunk = chunk;
+        } else {
+            chunk -> refs.store(1);
+        }
+        enqueue_event(AE_HttpBodyData, (void *) callbackCtx, (void *) chunk, NULL, 0);
+    }
+}
+
+static size_t seal_held_body_data(HeldBodyData& d) {
+    d.len = d.chunk -> state.fetch_or(BODY_CHUNK_SEALED) & ~BODY_CHUNK_SEALED;
+    return d.len;
+}
+
+static void discard_held_body_data(RequestBodyReadContext *callbackCtx) {
+    for(auto& d : callbackCtx -> held) {
+        callbackCtx -> inflight_bytes -= seal_held_body_data(d);
+        body_chunk_unref(d.chunk);
+    }
+    callbackCtx -> held.clear();
+}
+
+static void deliver_body_data(RequestBodyReadContext *callbackCtx, HeldBodyData d) {
+    Isolate *isolate = Isolate::GetCurrent();
+    HandleScope scope(isolate);
+
+    size_t len = seal_held_body_data(d);
+    callbackCtx -> inflight_bytes -= len;
+
+    MaybeLocal<Object> data_buf = node::Buffer::New(
+        isolate,
+        d.chunk -> data,
+        len,
+        [](char *data, void *hint) {
+            body_chunk_unref((BodyChunk *) hint);
+        },
+        (void *) d.chunk
+    );
+    assert(!data_buf.IsEmpty());
+
+    // An aborted read still frees the data, but JS no longer sees it.
+    if(callbackCtx -> shouldTerminate) {
+        return;
+    }
+
+    Local<Function> local_cb = Local<Function>::New(isolate, *callbackCtx -> onData);
+    Local<Value> argv[] = {
+        data_buf.ToLocalChecked()
+    };
+
+    Local<Value> ret = invoke_callback(
+        isolate,
+        local_cb,
+        1,
+        argv
+    );
+    if(ret -> BooleanValue() == false) {
+        callbackCtx -> shouldTerminate = true;
+    }
+}
+
+static void deliver_body_end(RequestBodyReadContext *callbackCtx, bool ok) {
+    Isolate *isolate = Isolate::GetCurrent();
+    HandleScope scope(isolate);
+
+    Local<Function> local_cb = Local<Function>::New(isolate, *callbackCtx -> onEnd);
+    Local<Value> argv[] = {
+        Boolean::New(isolate, ok)
+    };
+    // Release the JS callbacks now; the stream handle may outlive the read.
+    callbackCtx -> onData -> Reset();
+    callbackCtx -> onEnd -> Reset();
+
+    invoke_callback(
+        isolate,
+        local_cb,
+        1,
+        argv
+    );
+
+    body_read_context_unref(callbackCtx);
+}
+
+// Delivers held data until delivery is held again, then the end of the
+// body if it has already been read.
+static void drain_body_stream(RequestBodyReadContext *callbackCtx) {
+    if(callbackCtx -> draining) {
+        return;
+    }
+    callbackCtx -> draining = true;
+
+    while(!callbackCtx -> holding && !callbackCtx -> held.empty()) {
+        HeldBodyData d = callbackCtx -> held.front();
+        callbackCtx -> held.pop_front();
+        deliver_body_data(callbackCtx, d);
+    }
+
+    callbackCtx -> draining = false;
+
+    if(callbackCtx -> end_pending && callbackCtx -> held.empty()) {
+        callbackCtx -> end_pending = false;
+        deliver_body_end(callbackCtx, callbackCtx -> end_ok);
+    }
+}
+
+static void dispatch_http_body_data(AsyncEvent *ev) {
+    auto callbackCtx = (RequestBodyReadContext *) ev -> p0;
+
+    HeldBodyData d;
+    d.chunk = (BodyChunk *) ev -> p1;
+    d.len = 0;
+
+    if(callbackCtx -> holding || !callbackCtx -> held.empty()) {
+        callbackCtx -> held.push_back(d);
+    } else {
+        deliver_body_data(callbackCtx, d);
+    }
+}
+
+static void dispatch_http_body_end(AsyncEvent *ev) {
+    auto callbackCtx = (RequestBodyReadContext *) ev -> p0;
+    bool ok = (bool) ev -> len;
+
+    if(!callbackCtx -> held.empty()) {
+        callbackCtx -> end_pending = true;
+        callbackCtx -> end_ok = ok;
+        return;
+    }
+    deliver_body_end(callbackCtx, ok);
+}
+
+static void dispatch_http_body_resume(AsyncEvent *ev) {
+    drain_body_stream((RequestBodyReadContext *) ev -> p0);
+}
+
+static void http_request_take_and_read_body(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+    
+    Local<Object> target = args[0] -> ToObject();
+    NativeResource res = NativeResource::from_object(
+        target
+    );
+    assert(res.get_type() == NR_HttpRequest);
+    IceHttpRequest req = (IceHttpRequest) res.get_data();
+
+    NativeResource::reset_object(target);
+
+    Local<Function> onData = Local<Function>::Cast(args[1]);
+    Local<Function> onEnd = Local<Function>::Cast(args[2]);
+    size_t max_buffered = args[3] -> IsNumber() ? (size_t) args[3] -> NumberValue() : 0;
+
+    auto callbackCtx = new RequestBodyReadContext(
+        new Persistent<Function>(isolate, onData),
+        new Persistent<Function>(isolate, onEnd),
+        max_buffered
+    );
+
+    ice_http_request_take_and_read_body(
+        req,
+        [](const ice_uint8_t *data, ice_uint32_t len, void *call_with) -> ice_uint8_t {
+            auto callbackCtx = (RequestBodyReadContext *) call_with;
+
+            if(callbackCtx -> shouldTerminate) {
+                return 0;
+            }
+            size_t queued = callbackCtx -> inflight_bytes.fetch_add(len) + len;
+            if(callbackCtx -> max_buffered && queued > callbackCtx -> max_buffered) {
+                callbackCtx -> shouldTerminate = true;
+                return 0;
+            }
+
+            enqueue_body_data(callbackCtx, data, len);
+            return 1;
+        },
+        [](ice_uint8_t ok, void *call_with) {
+            close_open_body_chunk((RequestBodyReadContext *) call_with);
+            enqueue_event(AE_HttpBodyEnd, call_with, NULL, NULL, ok);
+        },
+        (void *) callbackCtx
+    );
+
+    args.GetReturnValue().Set(
+        NativeResource(NR_HttpBodyStream, (void *) callbackCtx).build_owned_object(isolate)
+    );
+}
+
+// Accumulates a whole request body on the reader thread so that JS sees a
+// single Buffer (or a single error) instead of one call per chunk.
+// The declared Content-Length is only trusted up to this much before any
+// data arrives, so that clients cannot pin memory by announcing large
+// bodies and sending nothing.
+static const size_t FULL_BODY_INITIAL_RESERVE = 65536;
+
+struct FullBodyReadContext {
+    std::unique_ptr<Persistent<Function>> cb;
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t max_len;
+    size_t expected_len;
+    bool too_large;
+
+    FullBodyReadContext(Persistent<Function> *_cb, size_t _max_len, size_t _expected_len)
+        : cb(_cb) {
+            len = 0;
+            cap = 0;
+            buf = NULL;
+            max_len = _max_len;
+            expected_len = _expected_len;
+            too_large = expected_len > max_len;
+
+            if(expected_len && !too_large) {
+                cap = std::min(expected_len, FULL_BODY_INITIAL_RESERVE);
+                buf = (char *) malloc(cap);
+                assert(buf);
+            }
+    }
+
+    ~FullBodyReadContext() {
+        cb -> Reset();
+        if(buf) free(buf);
+    }
+
+    bool append(const ice_uint8_t *data, size_t n) {
+        if(n > max_len - len) {
+            too_large = true;
+            return false;
+        }
+
+        if(len + n > cap) {
+            size_t new_cap = cap ? cap * 2 : 16384;
+            while(new_cap < len + n) new_cap *= 2;
+            // Stop at the declared length as long as the body fits in it.
+            if(len + n <= expected_len && new_cap > expected_len) new_cap = expected_len;
+            if(new_cap > max_len) new_cap = max_len;
+
+            buf = (char *) realloc(buf, new_cap);
+            assert(buf);
+            cap = new_cap;
+        }
+
+        memcpy(buf + len, data, n);
+        len += n;
+        return true;
+    }
+};
+
+static size_t get_declared_content_length(IceHttpRequest req) {
+    ice_owned_string_t value = ice_http_request_get_header_to_owned(req, "Content-Length");
+    if(!value) {
+        return 0;
+    }
+
+    size_t ret = (size_t) strtoull(value, NULL, 10);
+    ice_glue_destroy_cstring(value);
+    return ret;
+}
+
+static void dispatch_http_body_full(AsyncEvent *ev) {
+    auto callbackCtx = (FullBodyReadContext *) ev -> p0;
+    bool ok = (bool) ev -> len;
+
+    Isolate *isolate = Isolate::GetCurrent();
+    HandleScope scope(isolate);
+
+    Local<Function> local_cb = Local<Function>::New(isolate, *callbackCtx -> cb);
+    Local<Value> argv[2];
+
+    if(callbackCtx -> too_large) {
+        Local<Object> err = Exception::Error(
+            String::NewFromUtf8(isolate, "Request body too large")
+        ) -> ToObject();
+        err -> Set(String::NewFromUtf8(isolate, "status"), Number::New(isolate, 413));
+        argv[0] = err;
+        argv[1] = Null(isolate);
+    } else if(!ok) {
+        argv[0] = Exception::Error(
+            String::NewFromUtf8(isolate, "Request body read failed")
+        );
+        argv[1] = Null(isolate);
+    } else {
+        // The Buffer takes over the allocation.
+        MaybeLocal<Object> data_buf;
+        if(callbackCtx -> len) {
+            data_buf = node::Buffer::New(
+                isolate,
+                callbackCtx -> buf,
+                callbackCtx -> len,
+                [](char *data, void *hint) {
+                    free(data);
+                },
+                NULL
+            );
+            callbackCtx -> buf = NULL;
+        } else {
+            data_buf = node::Buffer::New(isolate, 0);
+        }
+        assert(!data_buf.IsEmpty());
+
+        argv[0] = Null(isolate);
+        argv[1] = data_buf.ToLocalChecked();
+    }
+
+    delete callbackCtx;
+
+    invoke_callback(
+        isolate,
+        local_cb,
+        2,
+        argv
+    );
+}
+
+static void http_request_read_full_body(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+
+    Local<Object> target = args[0] -> ToObject();
+    NativeResource res = NativeResource::from_object(
+        target
+    );
+    assert(res.get_type() == NR_HttpRequest);
+    IceHttpRequest req = (IceHttpRequest) res.get_data();
+
+    NativeResource::reset_object(target);
+
+    size_t max_len = (size_t) args[1] -> NumberValue();
+    Local<Function> cb = Local<Function>::Cast(args[2]);
+
+    // A declared length over the limit is rejected before any data is read.
+    auto callbackCtx = new FullBodyReadContext(
+        new Persistent<Function>(isolate, cb),
+        max_len,
+        get_declared_content_length(req)
+    );
+
+    ice_http_request_take_and_read_body(
+        req,
+        [](const ice_uint8_t *data, ice_uint32_t len, void *call_with) -> ice_uint8_t {
+            auto callbackCtx = (FullBodyReadContext *) call_with;
+            if(callbackCtx -> too_large) {
+                return 0;
+            }
+            return callbackCtx -> append(data, len) ? 1 : 0;
+        },
+        [](ice_uint8_t ok, void *call_with) {
+            enqueue_event(AE_HttpBodyFull, call_with, NULL, NULL, ok);
+        },
+        (void *) callbackCtx
+    );
+}
+
+// Data held for a stream nobody can resume any more is delivered from the
+// event loop, as this may run during GC.
+static void body_stream_handle_released(RequestBodyReadContext *callbackCtx) {
+    if(callbackCtx -> holding) {
+        callbackCtx -> holding = false;
+        if(!callbackCtx -> held.empty()) {
+            enqueue_event(AE_HttpBodyResume, (void *) callbackCtx, NULL, NULL, 0);
+        }
+    }
+    body_read_context_unref(callbackCtx);
+}
+
+static RequestBodyReadContext * body_stream_from_object(Local<Object> target) {
+    NativeResource res = NativeResource::from_object(target);
+    assert(res.get_type() == NR_HttpBodyStream);
+    return (RequestBodyReadContext *) res.get_data();
+}
+
+// Holds delivery to JS only; the core keeps reading the body meanwhile.
+static void http_body_stream_hold(const FunctionCallbackInfo<Value>& args) {
+    RequestBodyReadContext *callbackCtx = body_stream_from_object(args[0] -> ToObject());
+    callbackCtx -> holding = true;
+}
+
+static void http_body_stream_resume(const FunctionCallbackInfo<Value>& args) {
+    RequestBodyReadContext *callbackCtx = body_stream_from_object(args[0] -> ToObject());
+    callbackCtx -> holding = false;
+    drain_body_stream(callbackCtx);
+}
+
+static void http_body_stream_abort(const FunctionCallbackInfo<Value>& args) {
+    RequestBodyReadContext *callbackCtx = body_stream_from_object(args[0] -> ToObject());
+    callbackCtx -> shouldTerminate = true;
+    discard_held_body_data(callbackCtx);
+    if(callbackCtx -> end_pending) {
+        callbackCtx -> end_pending = false;
+        deliver_body_end(callbackCtx, callbackCtx -> end_ok);
+    }
+}
+
+static void storage_file_http_response_begin_send(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+    
+    Local<Object> arg0 = args[0] -> ToObject();
+    Local<Object> arg1 = args[1] -> ToObject();
+
+    NativeResource reqRes = NativeResource::from_object(
+        arg0
+    );
+    assert(reqRes.get_type() == NR_HttpRequest);
+    IceHttpRequest req = (IceHttpRequest) reqRes.get_data();
+
+    NativeResource respRes = NativeResource::from_object(
+        arg1
+    );
+    assert(respRes.get_type() == NR_HttpResponse);
+    IceHttpResponse resp = (IceHttpResponse) respRes.get_data();
+
+    InboundString path(isolate, args[2]);
+    ice_uint8_t ret = send_file(req, resp, *path);
+    args.GetReturnValue().Set(Boolean::New(isolate, (bool) ret));
+}
+
+static void rpc_server_config_create(const FunctionCallbackInfo<Value>& args) {
+    NativeResource res(
+        NR_RpcServerConfig,
+        (void *) ice_rpc_server_config_create()
+    );
+    args.GetReturnValue().Set(res.build_owned_object(args.GetIsolate()));
+}
+
+static void rpc_server_config_destroy(const FunctionCallbackInfo<Value>& args) {
+    Local<Object> arg0 = args[0] -> ToObject();
+    NativeResource res = NativeResource::from_object(
+        arg0
+    );
+    assert(res.get_type() == NR_RpcServerConfig);
+
+    release_native_resource(NR_RpcServerConfig, res.get_data());
+    NativeResource::reset_object(arg0);
+}
+
+static void dispatch_rpc_method_call(AsyncEvent *ev) {
+    auto pf = (Persistent<Function> *) ev -> p0;
+    auto ctx = (IceRpcCallContext) ev -> p1;
+
+    Isolate *isolate = Isolate::GetCurrent();
+    HandleScope scope(isolate);
+
+    auto cb = Local<Function>::New(isolate, *pf);
+
+    Local<Value> argv[] = {
+        NativeResource(NR_RpcCallContext, (void *) ctx).build_object(isolate)
+    };
+    invoke_callback(
+        isolate,
+        cb,
+        1,
+        argv
+    );
+}
+
+static void rpc_server_config_add_method(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+
+    Local<Object> arg0 = args[0] -> ToObject();
+    NativeResource res = NativeResource::from_object(
+        arg0
+    );
+    assert(res.get_type() == NR_RpcServerConfig);
+
+    auto config = (IceRpcServerConfig) res.get_data();
+
+    InboundString name(isolate, args[1]);
+
+    Local<Function> cb = Local<Function>::Cast(args[2]);
+    auto persistent_cb = new Persistent<Function>(isolate, cb);
+
+    ice_rpc_server_config_add_method(
+        config,
+        *name,
+        [](IceRpcCallContext ctx, void *call_with) {
+            enqueue_event(AE_RpcMethodCall, call_with, (void *) ctx, NULL, 0);
+        },
+        (void *) persistent_cb
+    );
+    pending_rpc_method_callbacks[config].push_back(persistent_cb);
+}
+
+static void rpc_server_create(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+    Local<Object> arg0 = args[0] -> ToObject();
+    NativeResource res = NativeResource::from_object(
+        arg0
+    );
+    assert(res.get_type() == NR_RpcServerConfig);
+
+    auto config = (IceRpcServerConfig) res.get_data();
+    NativeResource::reset_object(arg0);
+    pending_rpc_method_callbacks.erase(config);
+
+    IceRpcServer server = ice_rpc_server_create(config);
+    args.GetReturnValue().Set(
+        NativeResource(
+            NR_RpcServer,
+            (void *) server
+        ).build_object(isolate)
+    );
+}
+
+static void rpc_server_start(const FunctionCallbackInfo<Value>& args) {
+    Local<Object> arg0 = args[0] -> ToObject();
+    NativeResource res = NativeResource::from_object(
+        arg0
+    );
+    assert(res.get_type() == NR_RpcServer);
+    auto server = (IceRpcServer) res.get_data();
+
+    InboundString addr(args.GetIsolate(), args[1]);
+    ice_rpc_server_start(server, *addr);
+}
+
+static void rpc_call_context_get_num_params(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+
+    Local<Object> arg0 = args[0] -> ToObject();
+    NativeResource res = NativeResource::from_object(
+        arg0
+    );
+    assert(res.get_type() == NR_RpcCallContext);
+
+    auto ctx = (IceRpcCallContext) res.get_data();
+    int n = ice_rpc_call_context_get_num_params(ctx);
+
+    args.GetReturnValue().Set(
+        Number::New(isolate, n)
+    );
+}
+
+static void rpc_call_context_get_param(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+
+    Local<Object> arg0 = args[0] -> ToObject();
+    NativeResource res = NativeResource::from_object(
+        arg0
+    );
+    assert(res.get_type() == NR_RpcCallContext);
+
+    auto ctx = (IceRpcCallContext) res.get_data();
+    int pos = args[1] -> NumberValue();
+
+    IceRpcParam p = ice_rpc_call_context_get_param(ctx, pos);
+    if(p == NULL) {
+        args.GetReturnValue().Set(Null(isolate));
+    } else {
+        args.GetReturnValue().Set(
+            NativeResource(NR_RpcParam, (void *) p).build_owned_object(isolate)
+        );
+    }
+}
+
+static void rpc_call_context_end(const FunctionCallbackInfo<Value>& args) {
+    Local<Object> arg0 = args[0] -> ToObject();
+    NativeResource ctxRes = NativeResource::from_object(
+        arg0
+    );
+    assert(ctxRes.get_type() == NR_RpcCallContext);
+
+    Local<Object> arg1 = args[1] -> ToObject();
+    NativeResource retRes = NativeResource::from_object(
+        arg1
+    );
+    assert(retRes.get_type() == NR_RpcParam);
+
+    auto ctx = (IceRpcCallContext) ctxRes.get_data();
+    auto ret = (IceRpcParam) retRes.get_data();
+    NativeResource::reset_object(arg0);
+    NativeResource::reset_object(arg1);
+
+    ice_rpc_call_context_end(ctx, ret);
+}
+
+// Converts a param to a plain JS value. `type` is one of 'i' (i32),
+// 'f' (f64), 's' (string) or 'b' (bool). The core cannot report the type
+// of a param, so it has to be declared; null and error params are
+// recognized whatever the declared type.
+static Local<Value> rpc_param_to_js(Isolate *isolate, IceRpcParam p, char type) {
+    if(ice_rpc_param_is_null(p)) {
+        return Null(isolate);
+    }
+
+    IceRpcParam err = ice_rpc_param_get_error(p);
+    if(err) {
+        ice_owned_string_t str = ice_rpc_param_get_string_to_owned(err);
+        ice_rpc_param_destroy(err);
+
+        Local<String> message = str
+            ? Local<String>::Cast(build_string_from_ice_owned_string(isolate, str))
+            : String::NewFromUtf8(isolate, "RPC error");
+        return Exception::Error(message);
+    }
+
+    switch(type) {
+        case 'i':
+            return Integer::New(isolate, ice_rpc_param_get_i32(p));
+        case 'f':
+            return Number::New(isolate, ice_rpc_param_get_f64(p));
+        case 'b':
+            return Boolean::New(isolate, ice_rpc_param_get_bool(p));
+        case 's': {
+            ice_owned_string_t str = ice_rpc_param_get_string_to_owned(p);
+            if(str) {
+                return build_string_from_ice_owned_string(isolate, str);
+            }
+            return Null(isolate);
+        }
+        default:
+            assert(false);
+            return Null(isolate);
+    }
+}
+
+static bool is_rpc_signature_type(char type) {
+    return type == 'i' || type == 'f' || type == 's' || type == 'b';
+}
+
+// Builds a param from a number, string, boolean, null/undefined or Error.
+// A number becomes i32 or f64 as `type` declares, or without a declared
+// type, i32 if it is integral and in range and f64 otherwise. An Error
+// becomes an error param wrapping its message.
+static IceRpcParam rpc_param_from_js(Isolate *isolate, Local<Value> v, char type = 0) {
+    if(v -> IsNumber()) {
+        if(type == 'i' || (type != 'f' && v -> IsInt32())) {
+            return ice_rpc_param_build_i32(v -> Int32Value());
+        }
+        return ice_rpc_param_build_f64(v -> NumberValue());
+    }
+    if(v -> IsString()) {
+        InboundString str(isolate, v);
+        return ice_rpc_param_build_string(*str);
+    }
+    if(v -> IsBoolean()) {
+        return ice_rpc_param_build_bool(v -> BooleanValue());
+    }
+    if(v -> IsNativeError()) {
+        Local<Value> message = v -> ToObject() -> Get(String::NewFromUtf8(isolate, "message"));
+        InboundString str(isolate, message);
+        return ice_rpc_param_build_error(ice_rpc_param_build_string(*str));
+    }
+    return ice_rpc_param_build_null();
+}
+
+// rpc_call_context_get_params_as_js(ctx, signature): all params of a call
+// as an array of JS values, using one type character per param from
+// `signature`. Throws if a param has no valid type declared.
+static void rpc_call_context_get_params_as_js(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+
+    NativeResource res = NativeResource::from_object(args[0] -> ToObject());
+    assert(res.get_type() == NR_RpcCallContext);
+    auto ctx = (IceRpcCallContext) res.get_data();
+
+    InboundString sig(isolate, args[1]);
+    const char *signature = *sig;
+    size_t signature_len = strlen(signature);
+
+    ice_uint32_t n = ice_rpc_call_context_get_num_params(ctx);
+    if(n > signature_len) {
+        isolate -> ThrowException(Exception::TypeError(
+            String::NewFromUtf8(isolate, "RPC call has more params than its signature declares")
+        ));
+        return;
+    }
+    for(size_t i = 0; i < signature_len; i++) {
+        if(!is_rpc_signature_type(signature[i])) {
+            isolate -> ThrowException(Exception::TypeError(
+                String::NewFromUtf8(isolate, "Invalid type in RPC param signature")
+            ));
+            return;
+        }
+    }
+
+    Local<Array> ret = Array::New(isolate, n);
+
+    for(ice_uint32_t i = 0; i < n; i++) {
+        IceRpcParam p = ice_rpc_call_context_get_param(ctx, i);
+        if(p == NULL) {
+            ret -> Set(i, Null(isolate));
+            continue;
+        }
+
+        ret -> Set(i, rpc_param_to_js(isolate, p, signature[i]));
+        ice_rpc_param_destroy(p);
+    }
+
+    args.GetReturnValue().Set(ret);
+}
+
+// rpc_call_context_end_with_js(ctx, value)
+static void rpc_call_context_end_with_js(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+
+    Local<Object> arg0 = args[0] -> ToObject();
+    NativeResource ctxRes = NativeResource::from_object(
+        arg0
+    );
+    assert(ctxRes.get_type() == NR_RpcCallContext);
+
+    auto ctx = (IceRpcCallContext) ctxRes.get_data();
+    NativeResource::reset_object(arg0);
+
+    ice_rpc_call_context_end(ctx, rpc_param_from_js(isolate, args[1]));
+}
+
+static void rpc_param_build_i32(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+    int v = args[0] -> NumberValue();
+
+    IceRpcParam p = ice_rpc_param_build_i32(v);
+    NativeResource res(NR_RpcParam, (void *) p);
+
+    args.GetReturnValue().Set(res.build_owned_object(isolate));
+}
+
+static void rpc_param_build_f64(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+    double v = args[0] -> NumberValue();
+
+    IceRpcParam p = ice_rpc_param_build_f64(v);
+    NativeResource res(NR_RpcParam, (void *) p);
+
+    args.GetReturnValue().Set(res.build_owned_object(isolate));
+}
+
+static void rpc_param_build_string(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+    InboundString v(isolate, args[0]);
+
+    IceRpcParam p = ice_rpc_param_build_string(*v);
+    NativeResource res(NR_RpcParam, (void *) p);
+
+    args.GetReturnValue().Set(res.build_owned_object(isolate));
+}
+
+static void rpc_param_build_error(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+
     Local<Object> arg0 = args[0] -> ToObject();
-    NativeResource res = NativeResource::from_object(
-        arg0
+    NativeResource fromRes = NativeResource::from_object(arg0);
+
+    assert(fromRes.get_type() == NR_RpcParam);
+    auto from = (IceRpcParam) fromRes.get_data();
+
+    NativeResource::reset_object(arg0);
+
+    IceRpcParam p = ice_rpc_param_build_error(from);
+    NativeResource res(NR_RpcParam, (void *) p);
+
+    args.GetReturnValue().Set(res.build_owned_object(isolate));
+}
+
+static void rpc_param_build_bool(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+    bool v = args[0] -> BooleanValue();
+
+    IceRpcParam p = ice_rpc_param_build_bool(v);
+    NativeResource res(NR_RpcParam, (void *) p);
+
+    args.GetReturnValue().Set(res.build_owned_object(isolate));
+}
+
+static void rpc_param_build_null(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+
+    IceRpcParam p = ice_rpc_param_build_null();
+    NativeResource res(NR_RpcParam, (void *) p);
+
+    args.GetReturnValue().Set(res.build_owned_object(isolate));
+}
+
+// The core has no binary param type, so bytes travel as base64 in a
+// string param, after a tag that marks the string as bytes. The tag starts
+// with a control character so that ordinary strings are not mistaken for
+// bytes. Encoding and decoding happen here directly between the JS-side
+// memory and the param, without intermediate JS strings.
+static const char RPC_BYTES_TAG[] = "\x01" "b64:";
+static const size_t RPC_BYTES_TAG_LEN = sizeof(RPC_BYTES_TAG) - 1;
+
+static const char base64_chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Appends the encoding of data to out.
+static void base64_encode(const uint8_t *data, size_t len, std::string& out) {
+    size_t offset = out.size();
+    out.resize(offset + ((len + 2) / 3) * 4);
+    char *dst = &out[offset];
+
+    size_t i = 0;
+    for(; i + 2 < len; i += 3) {
+        uint32_t v = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+        *dst++ = base64_chars[(v >> 18) & 63];
+        *dst++ = base64_chars[(v >> 12) & 63];
+        *dst++ = base64_chars[(v >> 6) & 63];
+        *dst++ = base64_chars[v & 63];
+    }
+
+    if(i < len) {
+        uint32_t v = data[i] << 16;
+        if(i + 1 < len) v |= data[i + 1] << 8;
+
+        *dst++ = base64_chars[(v >> 18) & 63];
+        *dst++ = base64_chars[(v >> 12) & 63];
+        *dst++ = i + 1 < len ? base64_chars[(v >> 6) & 63] : '=';
+        *dst++ = '=';
+    }
+}
+
+static int base64_value(char c) {
+    if(c >= 'A' && c <= 'Z') return c - 'A';
+    if(c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if(c >= '0' && c <= '9') return c - '0' + 52;
+    if(c == '+') return 62;
+    if(c == '/') return 63;
+    return -1;
+}
+
+// Returns the number of bytes written to out (which must have room for
+// len / 4 * 3 bytes), or -1 if the input is not valid base64. Only the
+// canonical form is accepted: padding may appear only at the end of the
+// last quartet, and the bits it leaves unused must be zero.
+static long base64_decode(const char *src, size_t len, uint8_t *out) {
+    if(len % 4) {
+        return -1;
+    }
+
+    size_t n = 0;
+    for(size_t i = 0; i < len; i += 4) {
+        bool last = i + 4 == len;
+        bool pad_c = last && src[i + 2] == '=';
+        bool pad_d = last && src[i + 3] == '=';
+        if(pad_c && !pad_d) {
+            return -1;
+        }
+
+        int a = base64_value(src[i]);
+        int b = base64_value(src[i + 1]);
+        int c = pad_c ? 0 : base64_value(src[i + 2]);
+        int d = pad_d ? 0 : base64_value(src[i + 3]);
+        if(a < 0 || b < 0 || c < 0 || d < 0) {
+            return -1;
+        }
+        if((pad_c && (b & 15)) || (pad_d && (c & 3))) {
+            return -1;
+        }
+
+        uint32_t v = (a << 18) | (b << 12) | (c << 6) | d;
+        out[n++] = v >> 16;
+        if(!pad_c) out[n++] = (v >> 8) & 0xff;
+        if(!pad_d) out[n++] = v & 0xff;
+    }
+    return n;
+}
+
+static std::string base64_scratch;
+
+// rpc_param_build_bytes(view): builds a param from any ArrayBufferView
+// (Buffer, TypedArray or DataView).
+static void rpc_param_build_bytes(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+
+    Local<ArrayBufferView> view = Local<ArrayBufferView>::Cast(args[0]);
+    const uint8_t *data = (const uint8_t *) view -> Buffer() -> GetContents().Data() + view -> ByteOffset();
+
+    base64_scratch.assign(RPC_BYTES_TAG, RPC_BYTES_TAG_LEN);
+    base64_encode(data, view -> ByteLength(), base64_scratch);
+    IceRpcParam p = ice_rpc_param_build_string(base64_scratch.c_str());
+
+    args.GetReturnValue().Set(
+        NativeResource(NR_RpcParam, (void *) p).build_owned_object(isolate)
+    );
+}
+
+// Decodes a bytes param into a Buffer that owns the decoded memory.
+// Returns an empty handle if the param does not hold bytes.
+static MaybeLocal<Object> rpc_param_decode_bytes(Isolate *isolate, IceRpcParam p) {
+    ice_owned_string_t str = ice_rpc_param_get_string_to_owned(p);
+    if(str == NULL) {
+        return MaybeLocal<Object>();
+    }
+    if(strncmp(str, RPC_BYTES_TAG, RPC_BYTES_TAG_LEN) != 0) {
+        ice_glue_destroy_cstring(str);
+        return MaybeLocal<Object>();
+    }
+
+    size_t len = strlen(str) - RPC_BYTES_TAG_LEN;
+    uint8_t *data = (uint8_t *) malloc(len / 4 * 3 + 1);
+    assert(data);
+
+    long n = base64_decode(str + RPC_BYTES_TAG_LEN, len, data);
+    ice_glue_destroy_cstring(str);
+
+    if(n < 0) {
+        free(data);
+        return MaybeLocal<Object>();
+    }
+
+    return node::Buffer::New(
+        isolate,
+        (char *) data,
+        n,
+        [](char *data, void *hint) {
+            free(data);
+        },
+        NULL
+    );
+}
+
+static void rpc_param_get_bytes(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+
+    NativeResource res = NativeResource::from_object(args[0] -> ToObject());
+    assert(res.get_type() == NR_RpcParam);
+
+    Local<Object> buf;
+    if(rpc_param_decode_bytes(isolate, (IceRpcParam) res.get_data()).ToLocal(&buf)) {
+        args.GetReturnValue().Set(buf);
+    } else {
+        args.GetReturnValue().Set(Null(isolate));
+    }
+}
+
+// Same as rpc_param_get_bytes, viewed as a Float64Array over the decoded
+// memory.
+static void rpc_param_get_float64_array(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+
+    NativeResource res = NativeResource::from_object(args[0] -> ToObject());
+    assert(res.get_type() == NR_RpcParam);
+
+    Local<Object> buf;
+    if(!rpc_param_decode_bytes(isolate, (IceRpcParam) res.get_data()).ToLocal(&buf)
+        || node::Buffer::Length(buf) % sizeof(double) != 0) {
+        args.GetReturnValue().Set(Null(isolate));
+        return;
+    }
+
+    Local<Uint8Array> bytes = Local<Uint8Array>::Cast(buf);
+    args.GetReturnValue().Set(
+        Float64Array::New(bytes -> Buffer(), bytes -> ByteOffset(), node::Buffer::Length(buf) / sizeof(double))
+    );
+}
+
+static void rpc_param_get_i32(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+
+    NativeResource res = NativeResource::from_object(args[0] -> ToObject());
+    assert(res.get_type() == NR_RpcParam);
+    IceRpcParam p = (IceRpcParam) res.get_data();
+
+    int v = ice_rpc_param_get_i32(p);
+    args.GetReturnValue().Set(Number::New(isolate, v));
+}
+
+static void rpc_param_get_f64(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+
+    NativeResource res = NativeResource::from_object(args[0] -> ToObject());
+    assert(res.get_type() == NR_RpcParam);
+    IceRpcParam p = (IceRpcParam) res.get_data();
+
+    double v = ice_rpc_param_get_f64(p);
+    args.GetReturnValue().Set(Number::New(isolate, v));
+}
+
+static void rpc_param_get_string(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+
+    NativeResource res = NativeResource::from_object(args[0] -> ToObject());
+    assert(res.get_type() == NR_RpcParam);
+    IceRpcParam p = (IceRpcParam) res.get_data();
+
+    args.GetReturnValue().Set(
+        build_string_from_ice_owned_string(
+            isolate,
+            ice_rpc_param_get_string_to_owned(p)
+        )
+    );
+}
+
+static void rpc_param_get_bool(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+
+    NativeResource res = NativeResource::from_object(args[0] -> ToObject());
+    assert(res.get_type() == NR_RpcParam);
+    IceRpcParam p = (IceRpcParam) res.get_data();
+
+    bool v = ice_rpc_param_get_bool(p);
+    args.GetReturnValue().Set(Boolean::New(isolate, v));
+}
+
+static void rpc_param_get_error(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+
+    NativeResource res = NativeResource::from_object(args[0] -> ToObject());
+    assert(res.get_type() == NR_RpcParam);
+    IceRpcParam p = (IceRpcParam) res.get_data();
+
+    IceRpcParam v = ice_rpc_param_get_error(p);
+    if(v == NULL) {
+        args.GetReturnValue().Set(Null(isolate));
+    } else {
+        NativeResource ret(NR_RpcParam, (void *) v);
+        args.GetReturnValue().Set(ret.build_owned_object(isolate));
+    }
+}
+
+static void rpc_param_is_null(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+
+    NativeResource res = NativeResource::from_object(args[0] -> ToObject());
+    assert(res.get_type() == NR_RpcParam);
+    IceRpcParam p = (IceRpcParam) res.get_data();
+
+    bool ret = ice_rpc_param_is_null(p);
+    args.GetReturnValue().Set(Boolean::New(isolate, ret));
+}
+
+static void rpc_param_destroy(const FunctionCallbackInfo<Value>& args) {
+    Local<Object> arg0 = args[0] -> ToObject();
+
+    NativeResource res = NativeResource::from_object(arg0);
+    assert(res.get_type() == NR_RpcParam);
+    IceRpcParam p = (IceRpcParam) res.get_data();
+
+    NativeResource::reset_object(arg0);
+    ice_rpc_param_destroy(p);
+}
+
+static void rpc_param_clone(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+
+    NativeResource res = NativeResource::from_object(args[0] -> ToObject());
+    assert(res.get_type() == NR_RpcParam);
+    IceRpcParam p = (IceRpcParam) res.get_data();
+
+    IceRpcParam ret = ice_rpc_param_clone(p);
+
+    args.GetReturnValue().Set(
+        NativeResource(NR_RpcParam, (void *) ret).build_owned_object(isolate)
+    );
+}
+
+static void rpc_client_create(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+
+    InboundString addr(isolate, args[0]);
+    NativeResource res(
+        NR_RpcClient,
+        (void *) ice_rpc_client_create(*addr)
+    );
+
+    args.GetReturnValue().Set(
+        res.build_owned_object(isolate)
+    );
+}
+
+static void rpc_client_destroy(const FunctionCallbackInfo<Value>& args) {
+    Local<Object> arg0 = args[0] -> ToObject();
+
+    NativeResource res = NativeResource::from_object(arg0);
+    assert(res.get_type() == NR_RpcClient);
+
+    auto client = (IceRpcClient) res.get_data();
+    ice_rpc_client_destroy(client);
+
+    NativeResource::reset_object(arg0);
+}
+
+// Holds the client wrapper until the connect completes, so that the client
+// cannot be collected (and destroyed) while the core still uses it.
+struct RpcClientConnectContext {
+    Persistent<Function> cb;
+    Persistent<Object> client;
+};
+
+static void dispatch_rpc_client_connect(AsyncEvent *ev) {
+    auto connect_ctx = (RpcClientConnectContext *) ev -> p0;
+    auto conn = (IceRpcClientConnection) ev -> p1;
+
+    Isolate *isolate = Isolate::GetCurrent();
+    HandleScope scope(isolate);
+
+    Local<Function> cb = Local<Function>::New(isolate, connect_ctx -> cb);
+    connect_ctx -> cb.Reset();
+    connect_ctx -> client.Reset();
+    delete connect_ctx;
+
+    Local<Value> target_conn;
+
+    if(conn == NULL) {
+        target_conn = Null(isolate);
+    } else {
+        target_conn = NativeResource(
+            NR_RpcClientConnection,
+            (void *) conn
+        ).build_owned_object(isolate);
+    }
+
+    Local<Value> argv[] = {
+        target_conn
+    };
+    invoke_callback(
+        isolate,
+        cb,
+        1,
+        argv
+    );
+}
+
+static void rpc_client_connect(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+    Local<Object> client_obj = args[0] -> ToObject();
+    NativeResource res = NativeResource::from_object(client_obj);
+    assert(res.get_type() == NR_RpcClient);
+
+    auto client = (IceRpcClient) res.get_data();
+
+    auto connect_ctx = new RpcClientConnectContext();
+    connect_ctx -> cb.Reset(isolate, Local<Function>::Cast(args[1]));
+    connect_ctx -> client.Reset(isolate, client_obj);
+
+    ice_rpc_client_connect(
+        client,
+        [](IceRpcClientConnection conn, void *call_with) {
+            enqueue_event(AE_RpcClientConnect, call_with, (void *) conn, NULL, 0);
+        },
+        (void *) connect_ctx
     );
-    assert(res.get_type() == NR_RpcCallContext);
+}
 
-    auto ctx = (IceRpcCallContext) res.get_data();
-    int pos = args[1] -> NumberValue();
+static void rpc_client_connection_destroy(const FunctionCallbackInfo<Value>& args) {
+    Local<Object> arg0 = args[0] -> ToObject();
+    NativeResource res = NativeResource::from_object(arg0);
+    assert(res.get_type() == NR_RpcClientConnection);
 
-    IceRpcParam p = ice_rpc_call_context_get_param(ctx, pos);
-    if(p == NULL) {
-        args.GetReturnValue().Set(Null(isolate));
+    auto conn = (IceRpcClientConnection) res.get_data();
+    NativeResource::reset_object(arg0);
+
+    ice_rpc_client_connection_destroy(conn);
+}
+
+static void dispatch_rpc_call_return(AsyncEvent *ev) {
+    auto persistent_cb = (Persistent<Function> *) ev -> p0;
+    auto ret = (IceRpcParam) ev -> p1;
+
+    Isolate *isolate = Isolate::GetCurrent();
+    HandleScope scope(isolate);
+
+    Local<Function> cb = Local<Function>::New(isolate, *persistent_cb);
+    persistent_cb -> Reset();
+    delete persistent_cb;
+
+    Local<Value> targetRet;
+    if(ret == NULL) {
+        targetRet = Null(isolate);
     } else {
-        args.GetReturnValue().Set(
-            NativeResource(NR_RpcParam, (void *) p).build_object(isolate)
-        );
+        targetRet = NativeResource(NR_RpcParam, (void *) ret).build_owned_object(isolate);
     }
+    Local<Value> argv[] = {
+        targetRet
+    };
+    invoke_callback(
+        isolate,
+        cb,
+        1,
+        argv
+    );
 }
 
-static void rpc_call_context_end(const FunctionCallbackInfo<Value>& args) {
+static void on_rpc_call_return(const IceRpcParam ret_borrowed, void *call_with) {
+    IceRpcParam ret = NULL;
+    if(ret_borrowed) {
+        ret = ice_rpc_param_clone(ret_borrowed);
+    }
+    enqueue_event(AE_RpcCallReturn, call_with, (void *) ret, NULL, 0);
+}
+
+static void rpc_client_connection_call(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+
     Local<Object> arg0 = args[0] -> ToObject();
-    NativeResource ctxRes = NativeResource::from_object(
-        arg0
+    NativeResource res = NativeResource::from_object(arg0);
+    assert(res.get_type() == NR_RpcClientConnection);
+
+    auto conn = (IceRpcClientConnection) res.get_data();
+
+    InboundString method_name(isolate, args[1]);
+    Local<Array> params = Local<Array>::Cast(args[2]);
+    auto paramsLen = params -> Length();
+    std::vector<IceRpcParam> target_params;
+    target_params.reserve(paramsLen);
+
+    for(unsigned int i = 0; i < paramsLen; i++) {
+        auto paramObj = params -> Get(i) -> ToObject();
+        NativeResource paramRes = NativeResource::from_object(paramObj);
+        assert(paramRes.get_type() == NR_RpcParam);
+
+        IceRpcParam p = (IceRpcParam) paramRes.get_data();
+        NativeResource::reset_object(paramObj);
+
+        target_params.push_back(p);
+    }
+
+    Local<Function> cb = Local<Function>::Cast(args[3]);
+    auto persistent_cb = new Persistent<Function>(isolate, cb);
+
+    ice_rpc_client_connection_call(
+        conn,
+        *method_name,
+        target_params.data(),
+        target_params.size(),
+        on_rpc_call_return,
+        (void *) persistent_cb
     );
-    assert(ctxRes.get_type() == NR_RpcCallContext);
+}
 
-    Local<Object> arg1 = args[1] -> ToObject();
-    NativeResource retRes = NativeResource::from_object(
-        arg1
+// A call to a fixed method with a fixed number of arguments. The method
+// name is converted once and the argument array is reused across calls.
+// If a signature is given, plain numbers are built with the declared type.
+struct PreparedRpcCall {
+    std::string method;
+    std::string signature;
+    std::vector<IceRpcParam> params;
+};
+
+static void rpc_prepared_call_destroy(PreparedRpcCall *call) {
+    delete call;
+}
+
+// rpc_prepared_call_create(methodName, arity, signature). The signature
+// is empty, or holds one of i, f, s or b per param.
+static void rpc_prepared_call_create(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+
+    InboundString method_name(isolate, args[0]);
+    unsigned int arity = args[1] -> NumberValue();
+    InboundString signature(isolate, args[2]);
+
+    PreparedRpcCall *call = new PreparedRpcCall();
+    call -> method = *method_name;
+    call -> signature = *signature;
+    call -> params.resize(arity);
+    assert(call -> signature.empty() || call -> signature.size() == arity);
+
+    args.GetReturnValue().Set(
+        NativeResource(NR_RpcPreparedCall, (void *) call).build_owned_object(isolate)
     );
-    assert(retRes.get_type() == NR_RpcParam);
+}
 
-    auto ctx = (IceRpcCallContext) ctxRes.get_data();
-    auto ret = (IceRpcParam) retRes.get_data();
-    NativeResource::reset_object(arg0);
-    NativeResource::reset_object(arg1);
+// Takes an RpcParam (whose ownership passes to the call) or a plain JS
+// value, converted as with rpc_call_context_end_with_js.
+static IceRpcParam take_rpc_param_from_js(Isolate *isolate, Local<Value> v, char type = 0) {
+    if(NativeResource::is_wrapper(isolate, v)) {
+        Local<Object> obj = v -> ToObject();
+        NativeResource paramRes = NativeResource::from_object(obj);
+        assert(paramRes.get_type() == NR_RpcParam);
+        NativeResource::reset_object(obj);
+        return (IceRpcParam) paramRes.get_data();
+    }
+    return rpc_param_from_js(isolate, v, type);
+}
 
-    ice_rpc_call_context_end(ctx, ret);
+// rpc_prepared_call_invoke(call, conn, params, cb)
+static void rpc_prepared_call_invoke(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+
+    NativeResource callRes = NativeResource::from_object(args[0] -> ToObject());
+    assert(callRes.get_type() == NR_RpcPreparedCall);
+    PreparedRpcCall *call = (PreparedRpcCall *) callRes.get_data();
+
+    NativeResource connRes = NativeResource::from_object(args[1] -> ToObject());
+    assert(connRes.get_type() == NR_RpcClientConnection);
+    auto conn = (IceRpcClientConnection) connRes.get_data();
+
+    Local<Array> params = Local<Array>::Cast(args[2]);
+    assert(params -> Length() == call -> params.size());
+
+    for(unsigned int i = 0; i < call -> params.size(); i++) {
+        char type = call -> signature.empty() ? 0 : call -> signature[i];
+        call -> params[i] = take_rpc_param_from_js(isolate, params -> Get(i), type);
+    }
+
+    Local<Function> cb = Local<Function>::Cast(args[3]);
+    auto persistent_cb = new Persistent<Function>(isolate, cb);
+
+    ice_rpc_client_connection_call(
+        conn,
+        call -> method.c_str(),
+        call -> params.data(),
+        call -> params.size(),
+        on_rpc_call_return,
+        (void *) persistent_cb
+    );
+}
+
+// A group of calls submitted together. The calls are all issued before
+// any reply is awaited, and the replies are delivered to JS in a single
+// callback once the last one arrives.
+struct RpcBatch;
+
+struct RpcBatchSlot {
+    RpcBatch *batch;
+    unsigned int index;
+};
+
+struct RpcBatch {
+    std::unique_ptr<Persistent<Function>> cb;
+    std::vector<IceRpcParam> results;
+    std::vector<RpcBatchSlot> slots;
+    std::atomic<unsigned int> remaining;
+
+    RpcBatch(Persistent<Function> *_cb, unsigned int n) : cb(_cb), results(n, (IceRpcParam) NULL), slots(n) {
+        remaining = n;
+        for(unsigned int i = 0; i < n; i++) {
+            slots[i].batch = this;
+            slots[i].index = i;
+        }
+    }
+
+    ~RpcBatch() {
+        cb -> Reset();
+    }
+};
+
+static void on_rpc_batch_call_return(const IceRpcParam ret_borrowed, void *call_with) {
+    RpcBatchSlot *slot = (RpcBatchSlot *) call_with;
+    RpcBatch *batch = slot -> batch;
+
+    if(ret_borrowed) {
+        batch -> results[slot -> index] = ice_rpc_param_clone(ret_borrowed);
+    }
+    if(--batch -> remaining == 0) {
+        enqueue_event(AE_RpcBatchReturn, (void *) batch, NULL, NULL, 0);
+    }
+}
+
+static void dispatch_rpc_batch_return(AsyncEvent *ev) {
+    RpcBatch *batch = (RpcBatch *) ev -> p0;
+
+    Isolate *isolate = Isolate::GetCurrent();
+    HandleScope scope(isolate);
+
+    Local<Function> cb = Local<Function>::New(isolate, *batch -> cb);
+
+    unsigned int n = batch -> results.size();
+    Local<Array> results = Array::New(isolate, n);
+    for(unsigned int i = 0; i < n; i++) {
+        IceRpcParam ret = batch -> results[i];
+        if(ret == NULL) {
+            results -> Set(i, Null(isolate));
+        } else {
+            results -> Set(i, NativeResource(NR_RpcParam, (void *) ret).build_owned_object(isolate));
+        }
+    }
+    delete batch;
+
+    Local<Value> argv[] = {
+        results
+    };
+    invoke_callback(
+        isolate,
+        cb,
+        1,
+        argv
+    );
 }
 
-static void rpc_param_build_i32(const FunctionCallbackInfo<Value>& args) {
-    Isolate *isolate = args.GetIsolate();
-    int v = args[0] -> NumberValue();
+// rpc_client_connection_call_many(conn, [[method, params], ...], cb)
+static void rpc_client_connection_call_many(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+
+    NativeResource res = NativeResource::from_object(args[0] -> ToObject());
+    assert(res.get_type() == NR_RpcClientConnection);
+    auto conn = (IceRpcClientConnection) res.get_data();
+
+    Local<Array> calls = Local<Array>::Cast(args[1]);
+    unsigned int n_calls = calls -> Length();
+
+    Local<Function> cb = Local<Function>::Cast(args[2]);
+    RpcBatch *batch = new RpcBatch(new Persistent<Function>(isolate, cb), n_calls);
+
+    if(n_calls == 0) {
+        enqueue_event(AE_RpcBatchReturn, (void *) batch, NULL, NULL, 0);
+        return;
+    }
+
+    std::vector<IceRpcParam> target_params;
+
+    for(unsigned int i = 0; i < n_calls; i++) {
+        Local<Array> call = Local<Array>::Cast(calls -> Get(i));
+        InboundString method_name(isolate, call -> Get(0));
+        Local<Array> params = Local<Array>::Cast(call -> Get(1));
+        unsigned int n_params = params -> Length();
+
+        target_params.clear();
+        for(unsigned int j = 0; j < n_params; j++) {
+            target_params.push_back(take_rpc_param_from_js(isolate, params -> Get(j)));
+        }
+
+        ice_rpc_client_connection_call(
+            conn,
+            *method_name,
+            target_params.data(),
+            target_params.size(),
+            on_rpc_batch_call_return,
+            (void *) &batch -> slots[i]
+        );
+    }
+}
+
+// A set of connections to one or more addresses. Calls go to the usable
+// connection with the fewest outstanding requests. Connections that fail
+// to connect, or whose calls keep failing, are reconnected in the
+// background with exponential backoff. All pool state is only touched on
+// the JS thread; executor threads just enqueue events.
+static const uint64_t RPC_POOL_RECONNECT_MIN_MS = 100;
+static const uint64_t RPC_POOL_RECONNECT_MAX_MS = 5000;
+static const unsigned int RPC_POOL_MAX_CONSECUTIVE_FAILURES = 3;
+static const size_t RPC_POOL_LATENCY_SAMPLES = 128;
+static const size_t RPC_POOL_HEDGE_MIN_SAMPLES = 20;
+static const uint64_t RPC_POOL_PERCENTILE_REFRESH_SAMPLES = 16;
+static const uint64_t RPC_POOL_DEFAULT_CONNECT_WAIT_MS = 5000;
+
+// Passed to the pool call callback along with the reply.
+enum RpcPoolCallStatus {
+    RPCS_Done = 0,
+    RPCS_DeadlineExceeded,
+    RPCS_NoConnection,
+
+    // Every send of the call, hedge included, came back without a reply.
+    RPCS_Failed
+};
+
+struct RpcPoolEndpoint;
+
+struct RpcPoolConnection {
+    RpcPoolEndpoint *endpoint;
+    IceRpcClientConnection conn;
+    bool connecting;
+    bool broken;
+    unsigned int outstanding;
+    unsigned int consecutive_failures;
+    uint64_t reconnect_delay_ms;
+
+    // Loop time of the next connect attempt, or 0 if none is scheduled.
+    uint64_t next_attempt_ms;
+};
+
+struct RpcPoolEndpoint {
+    RpcClientPool *pool;
+    std::string addr;
+    IceRpcClient client;
+    std::vector<RpcPoolConnection> conns;
+
+    unsigned int inflight;
+    uint64_t calls;
+    uint64_t failures;
+    double avg_latency_us;
+
+    // Ring of the latest successful call latencies.
+    std::vector<uint32_t> recent_latency_us;
+    size_t recent_latency_next;
+    uint64_t latency_samples;
+
+    // Last computed hedge percentile (0 if none), and the sample count then.
+    double cached_percentile;
+    double cached_percentile_ms;
+    uint64_t cached_percentile_at;
+    std::vector<uint32_t> percentile_scratch;
+};
+
+struct RpcPoolRequest;
+struct RpcPoolAttempt;
+
+struct RpcClientPool {
+    std::vector<std::unique_ptr<RpcPoolEndpoint>> endpoints;
+    uv_timer_t reconnect_timer;
+    bool timer_active;
+    bool closed;
+    bool freed;
+
+    // Connect attempts and requests that have not completed yet.
+    unsigned int pending;
+    unsigned int next_pick;
+
+    // Calls made while no connection was usable, oldest first.
+    std::list<RpcPoolRequest *> waiting;
+
+    // Sends that have not been answered yet.
+    std::list<RpcPoolAttempt *> attempts;
+    uint64_t connect_wait_ms;
+
+    uint64_t hedges_issued;
+    uint64_t hedges_won;
+    uint64_t deadlines_exceeded;
+};
+
+// One logical call. It may be sent twice when hedging; the first reply
+// wins and later ones are dropped, since the core cannot cancel a call.
+struct RpcPoolRequest {
+    RpcClientPool *pool;
+    std::string method;
+    std::unique_ptr<Persistent<Function>> cb;
+
+    // Kept until the hedge is sent, as each send consumes its params.
+    std::vector<IceRpcParam> hedge_params;
+
+    // Set while the call waits for a connection, which it holds the
+    // params for until then.
+    bool waiting;
+    std::list<RpcPoolRequest *>::iterator wait_pos;
+    std::vector<IceRpcParam> params;
+    uint64_t wait_until_ms;
+    uint64_t hedge_delay_ms;
+    double hedge_percentile;
+
+    uv_timer_t timer;
+    bool timer_open;
+
+    // Loop times, or 0 if not set.
+    uint64_t deadline_ms;
+    uint64_t hedge_at_ms;
+
+    RpcPoolConnection *primary;
+    unsigned int attempts;
+    bool done;
+};
+
+struct RpcPoolAttempt {
+    RpcPoolRequest *req;
+    RpcPoolConnection *c;
+    uint64_t start_ns;
+    bool is_hedge;
+
+    // Set when the pool is closed first; the reply is then dropped.
+    bool detached;
+    std::list<RpcPoolAttempt *>::iterator pos;
+};
+
+static void rpc_pool_connect(RpcPoolConnection *c) {
+    c -> connecting = true;
+    c -> endpoint -> pool -> pending++;
+
+    ice_rpc_client_connect(
+        c -> endpoint -> client,
+        [](IceRpcClientConnection conn, void *call_with) {
+            enqueue_event(AE_RpcPoolConnect, call_with, (void *) conn, NULL, 0);
+        },
+        (void *) c
+    );
+}
+
+static void rpc_pool_on_reconnect_timer(uv_timer_t *timer) {
+    RpcClientPool *pool = (RpcClientPool *) timer -> data;
+    uint64_t now = uv_now(uv_default_loop());
+    bool waiting = false;
+
+    for(auto& e : pool -> endpoints) {
+        for(auto& c : e -> conns) {
+            if(!c.next_attempt_ms) {
+                continue;
+            }
+            if(now >= c.next_attempt_ms) {
+                c.next_attempt_ms = 0;
+                rpc_pool_connect(&c);
+            } else {
+                waiting = true;
+            }
+        }
+    }
+
+    if(!waiting) {
+        uv_timer_stop(timer);
+        pool -> timer_active = false;
+    }
+}
+
+static void rpc_pool_schedule_reconnect(RpcPoolConnection *c) {
+    RpcClientPool *pool = c -> endpoint -> pool;
+
+    c -> next_attempt_ms = uv_now(uv_default_loop()) + c -> reconnect_delay_ms;
+    c -> reconnect_delay_ms = std::min(c -> reconnect_delay_ms * 2, RPC_POOL_RECONNECT_MAX_MS);
+
+    if(!pool -> timer_active) {
+        uv_timer_start(&pool -> reconnect_timer, rpc_pool_on_reconnect_timer, RPC_POOL_RECONNECT_MIN_MS, RPC_POOL_RECONNECT_MIN_MS);
+        pool -> timer_active = true;
+    }
+}
+
+static void rpc_pool_maybe_free(RpcClientPool *pool) {
+    if(!pool -> closed || pool -> pending || pool -> freed) {
+        return;
+    }
+    pool -> freed = true;
+
+    for(auto& e : pool -> endpoints) {
+        for(auto& c : e -> conns) {
+            if(c.conn) {
+                ice_rpc_client_connection_destroy(c.conn);
+                c.conn = NULL;
+            }
+        }
+        ice_rpc_client_destroy(e -> client);
+    }
+
+    uv_timer_stop(&pool -> reconnect_timer);
+    uv_close((uv_handle_t *) &pool -> reconnect_timer, [](uv_handle_t *handle) {
+        delete (RpcClientPool *) handle -> data;
+    });
+}
+
+static void rpc_pool_wake_waiting(RpcClientPool *pool);
+static void rpc_pool_fail_on_close(RpcPoolRequest *req);
+
+// Calls that are waiting for a connection or for a reply fail, as a peer
+// may never answer. Their sends are detached from the pool, so that late
+// replies are dropped, and the pool is freed once the calls have been
+// called back.
+static void rpc_client_pool_close(RpcClientPool *pool) {
+    pool -> closed = true;
+
+    std::vector<RpcPoolRequest *> unanswered;
+    for(auto attempt : pool -> attempts) {
+        attempt -> detached = true;
+        attempt -> c -> outstanding--;
+        attempt -> c -> endpoint -> inflight--;
+        if(--attempt -> req -> attempts == 0) {
+            unanswered.push_back(attempt -> req);
+        }
+    }
+    pool -> attempts.clear();
+
+    for(auto req : unanswered) {
+        rpc_pool_fail_on_close(req);
+    }
+    rpc_pool_wake_waiting(pool);
+    rpc_pool_maybe_free(pool);
+}
+
+static void dispatch_rpc_pool_connect(AsyncEvent *ev) {
+    RpcPoolConnection *c = (RpcPoolConnection *) ev -> p0;
+    IceRpcClientConnection conn = (IceRpcClientConnection) ev -> p1;
+    RpcClientPool *pool = c -> endpoint -> pool;
+
+    c -> connecting = false;
+    pool -> pending--;
+
+    if(conn) {
+        c -> conn = conn;
+        c -> broken = false;
+        c -> consecutive_failures = 0;
+        c -> reconnect_delay_ms = RPC_POOL_RECONNECT_MIN_MS;
+        rpc_pool_wake_waiting(pool);
+    } else if(!pool -> closed) {
+        rpc_pool_schedule_reconnect(c);
+    }
+
+    rpc_pool_maybe_free(pool);
+}
+
+// Picks the usable connection with the fewest outstanding calls. With
+// `avoid` set, that connection is skipped and other endpoints are preferred.
+static RpcPoolConnection * rpc_pool_pick(RpcClientPool *pool, RpcPoolConnection *avoid = NULL) {
+    RpcPoolConnection *best = NULL;
+    bool best_other_endpoint = false;
+    size_t n_endpoints = pool -> endpoints.size();
+    unsigned int start = pool -> next_pick++;
+
+    for(size_t i = 0; i < n_endpoints; i++) {
+        RpcPoolEndpoint *e = pool -> endpoints[(start + i) % n_endpoints].get();
+        bool other_endpoint = avoid && e != avoid -> endpoint;
+
+        for(auto& c : e -> conns) {
+            if(!c.conn || c.broken || &c == avoid) {
+                continue;
+            }
+            if(!best
+                || (other_endpoint && !best_other_endpoint)
+                || (other_endpoint == best_other_endpoint && c.outstanding < best -> outstanding)
+            ) {
+                best = &c;
+                best_other_endpoint = other_endpoint;
+            }
+        }
+    }
+    return best;
+}
+
+// Returns the given percentile of the endpoint's recent latencies, in
+// milliseconds, or -1 if there are too few samples. The result is reused
+// until enough new samples have come in.
+static double rpc_pool_latency_percentile_ms(RpcPoolEndpoint *e, double percentile) {
+    if(e -> recent_latency_us.size() < RPC_POOL_HEDGE_MIN_SAMPLES) {
+        return -1;
+    }
+    if(
+        e -> cached_percentile == percentile
+        && e -> latency_samples - e -> cached_percentile_at < RPC_POOL_PERCENTILE_REFRESH_SAMPLES
+    ) {
+        return e -> cached_percentile_ms;
+    }
+
+    std::vector<uint32_t>& samples = e -> percentile_scratch;
+    samples.assign(e -> recent_latency_us.begin(), e -> recent_latency_us.end());
+
+    size_t k = std::min(samples.size() - 1, (size_t) (samples.size() * percentile / 100.0));
+    std::nth_element(samples.begin(), samples.begin() + k, samples.end());
+
+    e -> cached_percentile = percentile;
+    e -> cached_percentile_ms = samples[k] / 1000.0;
+    e -> cached_percentile_at = e -> latency_samples;
+    return e -> cached_percentile_ms;
+}
+
+static void rpc_pool_send_attempt(RpcPoolRequest *req, RpcPoolConnection *c, std::vector<IceRpcParam>& params, bool is_hedge) {
+    RpcPoolAttempt *attempt = new RpcPoolAttempt();
+    attempt -> req = req;
+    attempt -> c = c;
+    attempt -> start_ns = uv_hrtime();
+    attempt -> is_hedge = is_hedge;
+    attempt -> detached = false;
+    attempt -> pos = req -> pool -> attempts.insert(req -> pool -> attempts.end(), attempt);
+
+    c -> outstanding++;
+    c -> endpoint -> inflight++;
+    req -> attempts++;
+
+    ice_rpc_client_connection_call(
+        c -> conn,
+        req -> method.c_str(),
+        params.data(),
+        params.size(),
+        [](const IceRpcParam ret_borrowed, void *call_with) {
+            IceRpcParam ret = NULL;
+            if(ret_borrowed) {
+                ret = ice_rpc_param_clone(ret_borrowed);
+            }
+            enqueue_event(AE_RpcPoolCallReturn, call_with, (void *) ret, NULL, 0);
+        },
+        (void *) attempt
+    );
+}
+
+static void rpc_pool_request_maybe_free(RpcPoolRequest *req) {
+    if(!req -> done || req -> attempts || req -> timer_open) {
+        return;
+    }
+
+    RpcClientPool *pool = req -> pool;
+    delete req;
+
+    pool -> pending--;
+    rpc_pool_maybe_free(pool);
+}
+
+static void rpc_pool_request_stop_timer(RpcPoolRequest *req) {
+    if(!req -> timer_open) {
+        return;
+    }
+    uv_timer_stop(&req -> timer);
+    uv_close((uv_handle_t *) &req -> timer, [](uv_handle_t *handle) {
+        RpcPoolRequest *req = (RpcPoolRequest *) handle -> data;
+        req -> timer_open = false;
+        rpc_pool_request_maybe_free(req);
+    });
+}
+
+// Calls back with the reply (or null) and an RpcPoolCallStatus.
+static void rpc_pool_request_finish(RpcPoolRequest *req, IceRpcParam ret, RpcPoolCallStatus status) {
+    req -> done = true;
+    rpc_pool_request_stop_timer(req);
+
+    if(req -> waiting) {
+        req -> pool -> waiting.erase(req -> wait_pos);
+        req -> waiting = false;
+    }
+    for(auto p : req -> params) {
+        ice_rpc_param_destroy(p);
+    }
+    req -> params.clear();
+    for(auto p : req -> hedge_params) {
+        ice_rpc_param_destroy(p);
+    }
+    req -> hedge_params.clear();
+
+    Isolate *isolate = Isolate::GetCurrent();
+    HandleScope scope(isolate);
+
+    Local<Function> cb = Local<Function>::New(isolate, *req -> cb);
+    req -> cb -> Reset();
+
+    Local<Value> argv[] = {
+        ret ? (Local<Value>) NativeResource(NR_RpcParam, (void *) ret).build_owned_object(isolate) : (Local<Value>) Null(isolate),
+        Integer::New(isolate, status)
+    };
+
+    invoke_callback(
+        isolate,
+        cb,
+        2,
+        argv
+    );
+}
+
+static void rpc_pool_request_arm_timer(RpcPoolRequest *req) {
+    uint64_t now = uv_now(uv_default_loop());
+
+    uint64_t next = req -> deadline_ms;
+    if(req -> hedge_at_ms && (!next || req -> hedge_at_ms < next)) {
+        next = req -> hedge_at_ms;
+    }
+    if(req -> waiting || req -> pool -> closed) {
+        uint64_t wait_until = req -> pool -> closed ? now : req -> wait_until_ms;
+        if(!next || wait_until < next) {
+            next = wait_until;
+        }
+    }
+    if(!next) {
+        rpc_pool_request_stop_timer(req);
+        return;
+    }
+
+    uv_timer_start(&req -> timer, [](uv_timer_t *timer) {
+        RpcPoolRequest *req = (RpcPoolRequest *) timer -> data;
+        RpcClientPool *pool = req -> pool;
+        uint64_t now = uv_now(uv_default_loop());
 
-    IceRpcParam p = ice_rpc_param_build_i32(v);
-    NativeResource res(NR_RpcParam, (void *) p);
+        if(req -> deadline_ms && now >= req -> deadline_ms) {
+            pool -> deadlines_exceeded++;
+            rpc_pool_request_finish(req, NULL, RPCS_DeadlineExceeded);
+            rpc_pool_request_maybe_free(req);
+            return;
+        }
 
-    args.GetReturnValue().Set(res.build_object(isolate));
-}
+        if(pool -> closed || (req -> waiting && now >= req -> wait_until_ms)) {
+            rpc_pool_request_finish(req, NULL, RPCS_NoConnection);
+            rpc_pool_request_maybe_free(req);
+            return;
+        }
 
-static void rpc_param_build_f64(const FunctionCallbackInfo<Value>& args) {
-    Isolate *isolate = args.GetIsolate();
-    double v = args[0] -> NumberValue();
+        if(req -> hedge_at_ms && now >= req -> hedge_at_ms) {
+            req -> hedge_at_ms = 0;
 
-    IceRpcParam p = ice_rpc_param_build_f64(v);
-    NativeResource res(NR_RpcParam, (void *) p);
+            RpcPoolConnection *c = pool -> closed ? NULL : rpc_pool_pick(pool, req -> primary);
+            if(c) {
+                pool -> hedges_issued++;
+                rpc_pool_send_attempt(req, c, req -> hedge_params, true);
+            } else {
+                for(auto p : req -> hedge_params) {
+                    ice_rpc_param_destroy(p);
+                }
+            }
+            req -> hedge_params.clear();
+        }
 
-    args.GetReturnValue().Set(res.build_object(isolate));
+        rpc_pool_request_arm_timer(req);
+    }, next > now ? next - now : 0, 0);
 }
 
-static void rpc_param_build_string(const FunctionCallbackInfo<Value>& args) {
-    Isolate *isolate = args.GetIsolate();
-    String::Utf8Value v(args[0] -> ToString());
-
-    IceRpcParam p = ice_rpc_param_build_string(*v);
-    NativeResource res(NR_RpcParam, (void *) p);
+// Sends the first attempt. The hedge delay counts from here, and a
+// percentile delay is taken from the latencies of the chosen endpoint.
+static void rpc_pool_request_start(RpcPoolRequest *req, RpcPoolConnection *c, std::vector<IceRpcParam>& params) {
+    uint64_t now = uv_now(uv_default_loop());
+    req -> primary = c;
 
-    args.GetReturnValue().Set(res.build_object(isolate));
+    if(req -> hedge_percentile) {
+        double hedge_ms = rpc_pool_latency_percentile_ms(c -> endpoint, req -> hedge_percentile);
+        req -> hedge_delay_ms = hedge_ms > 0 ? (uint64_t) std::max(hedge_ms, 1.0) : 0;
+    }
+    if(req -> hedge_delay_ms && (!req -> deadline_ms || now + req -> hedge_delay_ms < req -> deadline_ms)) {
+        req -> hedge_at_ms = now + req -> hedge_delay_ms;
+    } else {
+        for(auto p : req -> hedge_params) {
+            ice_rpc_param_destroy(p);
+        }
+        req -> hedge_params.clear();
+    }
+    if(req -> timer_open) {
+        rpc_pool_request_arm_timer(req);
+    }
+    rpc_pool_send_attempt(req, c, params, false);
 }
 
-static void rpc_param_build_error(const FunctionCallbackInfo<Value>& args) {
-    Isolate *isolate = args.GetIsolate();
-
-    Local<Object> arg0 = args[0] -> ToObject();
-    NativeResource fromRes = NativeResource::from_object(arg0);
+// Starts waiting calls on connections that have become usable. Once the
+// pool is closed, their timers are fired right away to fail them instead.
+static void rpc_pool_wake_waiting(RpcClientPool *pool) {
+    if(pool -> closed) {
+        for(auto req : pool -> waiting) {
+            rpc_pool_request_arm_timer(req);
+        }
+        return;
+    }
 
-    assert(fromRes.get_type() == NR_RpcParam);
-    auto from = (IceRpcParam) fromRes.get_data();
+    while(!pool -> waiting.empty()) {
+        RpcPoolConnection *c = rpc_pool_pick(pool);
+        if(!c) {
+            break;
+        }
 
-    NativeResource::reset_object(arg0);
+        RpcPoolRequest *req = pool -> waiting.front();
+        pool -> waiting.pop_front();
+        req -> waiting = false;
 
-    IceRpcParam p = ice_rpc_param_build_error(from);
-    NativeResource res(NR_RpcParam, (void *) p);
+        std::vector<IceRpcParam> params;
+        params.swap(req -> params);
+        rpc_pool_request_start(req, c, params);
+    }
+}
 
-    args.GetReturnValue().Set(res.build_object(isolate));
+// Fails a call that lost its sends to rpc_client_pool_close. JS is called
+// back from the call's timer, as closing may happen during GC.
+static void rpc_pool_fail_on_close(RpcPoolRequest *req) {
+    if(req -> done) {
+        rpc_pool_request_maybe_free(req);
+        return;
+    }
+    if(!req -> timer_open) {
+        uv_timer_init(uv_default_loop(), &req -> timer);
+        req -> timer.data = (void *) req;
+        req -> timer_open = true;
+    }
+    rpc_pool_request_arm_timer(req);
 }
 
-static void rpc_param_build_bool(const FunctionCallbackInfo<Value>& args) {
-    Isolate *isolate = args.GetIsolate();
-    bool v = args[0] -> BooleanValue();
+static void dispatch_rpc_pool_call_return(AsyncEvent *ev) {
+    RpcPoolAttempt *attempt = (RpcPoolAttempt *) ev -> p0;
+    IceRpcParam ret = (IceRpcParam) ev -> p1;
 
-    IceRpcParam p = ice_rpc_param_build_bool(v);
-    NativeResource res(NR_RpcParam, (void *) p);
+    if(attempt -> detached) {
+        if(ret) {
+            ice_rpc_param_destroy(ret);
+        }
+        delete attempt;
+        return;
+    }
 
-    args.GetReturnValue().Set(res.build_object(isolate));
-}
+    RpcPoolRequest *req = attempt -> req;
+    RpcPoolConnection *c = attempt -> c;
+    RpcPoolEndpoint *e = c -> endpoint;
+    RpcClientPool *pool = e -> pool;
+
+    pool -> attempts.erase(attempt -> pos);
+    c -> outstanding--;
+    e -> inflight--;
+    req -> attempts--;
+
+    uint64_t latency_ns = uv_hrtime() - attempt -> start_ns;
+    double latency_us = latency_ns / 1000.0;
+    e -> avg_latency_us = e -> calls ? e -> avg_latency_us * 0.9 + latency_us * 0.1 : latency_us;
+    e -> calls++;
+
+    if(ret) {
+        c -> consecutive_failures = 0;
+
+        if(e -> recent_latency_us.size() < RPC_POOL_LATENCY_SAMPLES) {
+            e -> recent_latency_us.push_back(latency_ns / 1000);
+        } else {
+            e -> recent_latency_us[e -> recent_latency_next] = latency_ns / 1000;
+            e -> recent_latency_next = (e -> recent_latency_next + 1) % RPC_POOL_LATENCY_SAMPLES;
+        }
+        e -> latency_samples++;
+    } else {
+        e -> failures++;
+        if(++c -> consecutive_failures >= RPC_POOL_MAX_CONSECUTIVE_FAILURES) {
+            c -> broken = true;
+        }
+    }
 
-static void rpc_param_build_null(const FunctionCallbackInfo<Value>& args) {
-    Isolate *isolate = args.GetIsolate();
+    // Replace a connection that keeps failing once nothing uses it.
+    if(c -> broken && c -> outstanding == 0 && c -> conn && !pool -> closed) {
+        ice_rpc_client_connection_destroy(c -> conn);
+        c -> conn = NULL;
+        rpc_pool_schedule_reconnect(c);
+    }
 
-    IceRpcParam p = ice_rpc_param_build_null();
-    NativeResource res(NR_RpcParam, (void *) p);
+    bool is_hedge = attempt -> is_hedge;
+    delete attempt;
+
+    if(req -> done) {
+        if(ret) {
+            ice_rpc_param_destroy(ret);
+        }
+    } else if(ret) {
+        if(is_hedge) {
+            pool -> hedges_won++;
+        }
+        rpc_pool_request_finish(req, ret, RPCS_Done);
+    } else if(req -> attempts == 0) {
+        rpc_pool_request_finish(req, NULL, RPCS_Failed);
+    }
 
-    args.GetReturnValue().Set(res.build_object(isolate));
+    rpc_pool_request_maybe_free(req);
 }
 
-static void rpc_param_get_i32(const FunctionCallbackInfo<Value>& args) {
+// rpc_client_pool_create([addr, ...], connectionsPerAddress, connectWaitMs)
+// A connect wait of 0 selects the default.
+static void rpc_client_pool_create(const FunctionCallbackInfo<Value>& args) {
     Isolate *isolate = args.GetIsolate();
 
-    NativeResource res = NativeResource::from_object(args[0] -> ToObject());
-    assert(res.get_type() == NR_RpcParam);
-    IceRpcParam p = (IceRpcParam) res.get_data();
+    Local<Array> addrs = Local<Array>::Cast(args[0]);
+    unsigned int conns_per_addr = args[1] -> NumberValue();
+    assert(conns_per_addr > 0);
+
+    RpcClientPool *pool = new RpcClientPool();
+    pool -> timer_active = false;
+    pool -> closed = false;
+    pool -> freed = false;
+    pool -> pending = 0;
+    pool -> next_pick = 0;
+    pool -> hedges_issued = 0;
+    pool -> hedges_won = 0;
+    pool -> deadlines_exceeded = 0;
+    pool -> connect_wait_ms = args[2] -> IsNumber() && args[2] -> NumberValue() > 0
+        ? (uint64_t) args[2] -> NumberValue()
+        : RPC_POOL_DEFAULT_CONNECT_WAIT_MS;
+
+    uv_timer_init(uv_default_loop(), &pool -> reconnect_timer);
+    uv_unref((uv_handle_t *) &pool -> reconnect_timer);
+    pool -> reconnect_timer.data = (void *) pool;
+
+    for(unsigned int i = 0; i < addrs -> Length(); i++) {
+        InboundString addr(isolate, addrs -> Get(i));
+
+        RpcPoolEndpoint *e = new RpcPoolEndpoint();
+        e -> pool = pool;
+        e -> addr = *addr;
+        e -> client = ice_rpc_client_create(*addr);
+        e -> inflight = 0;
+        e -> calls = 0;
+        e -> failures = 0;
+        e -> avg_latency_us = 0;
+        e -> recent_latency_next = 0;
+        e -> latency_samples = 0;
+        e -> cached_percentile = 0;
+        e -> cached_percentile_ms = 0;
+        e -> cached_percentile_at = 0;
+
+        e -> conns.resize(conns_per_addr);
+        for(auto& c : e -> conns) {
+            c.endpoint = e;
+            c.conn = NULL;
+            c.connecting = false;
+            c.broken = false;
+            c.outstanding = 0;
+            c.consecutive_failures = 0;
+            c.reconnect_delay_ms = RPC_POOL_RECONNECT_MIN_MS;
+            c.next_attempt_ms = 0;
+        }
+        pool -> endpoints.emplace_back(e);
+    }
 
-    int v = ice_rpc_param_get_i32(p);
-    args.GetReturnValue().Set(Number::New(isolate, v));
+    for(auto& e : pool -> endpoints) {
+        for(auto& c : e -> conns) {
+            rpc_pool_connect(&c);
+        }
+    }
+
+    args.GetReturnValue().Set(
+        NativeResource(NR_RpcClientPool, (void *) pool).build_owned_object(isolate)
+    );
 }
 
-static void rpc_param_get_f64(const FunctionCallbackInfo<Value>& args) {
+static RpcClientPool * rpc_client_pool_from_object(Local<Object> target) {
+    NativeResource res = NativeResource::from_object(target);
+    assert(res.get_type() == NR_RpcClientPool);
+    return (RpcClientPool *) res.get_data();
+}
+
+// rpc_client_pool_call(pool, method, params, cb, deadlineMs, hedgeMs,
+// hedgePercentile). A zero deadline means none. The hedge is sent after
+// hedgeMs if positive, or else after the given percentile of recent
+// latencies to the chosen endpoint if that is positive. cb receives
+// (reply or null, RpcPoolCallStatus). Without a usable connection the call
+// waits for one until its deadline, or the pool's connect wait if it has
+// none.
+static void rpc_client_pool_call(const FunctionCallbackInfo<Value>& args) {
     Isolate *isolate = args.GetIsolate();
+    RpcClientPool *pool = rpc_client_pool_from_object(args[0] -> ToObject());
 
-    NativeResource res = NativeResource::from_object(args[0] -> ToObject());
-    assert(res.get_type() == NR_RpcParam);
-    IceRpcParam p = (IceRpcParam) res.get_data();
+    InboundString method_name(isolate, args[1]);
+    Local<Array> params = Local<Array>::Cast(args[2]);
+    unsigned int n_params = params -> Length();
 
-    double v = ice_rpc_param_get_f64(p);
-    args.GetReturnValue().Set(Number::New(isolate, v));
-}
+    double deadline_ms = args[4] -> IsNumber() ? args[4] -> NumberValue() : 0;
+    double hedge_ms = args[5] -> IsNumber() ? args[5] -> NumberValue() : 0;
+    double hedge_percentile = args[6] -> IsNumber() ? args[6] -> NumberValue() : 0;
+    if(hedge_ms > 0 || hedge_percentile < 0) {
+        hedge_percentile = 0;
+    }
 
-static void rpc_param_get_string(const FunctionCallbackInfo<Value>& args) {
-    Isolate *isolate = args.GetIsolate();
+    std::vector<IceRpcParam> target_params;
+    target_params.reserve(n_params);
+    for(unsigned int i = 0; i < n_params; i++) {
+        target_params.push_back(take_rpc_param_from_js(isolate, params -> Get(i)));
+    }
 
-    NativeResource res = NativeResource::from_object(args[0] -> ToObject());
-    assert(res.get_type() == NR_RpcParam);
-    IceRpcParam p = (IceRpcParam) res.get_data();
+    RpcPoolConnection *c = pool -> waiting.empty() ? rpc_pool_pick(pool) : NULL;
+    uint64_t now = uv_now(uv_default_loop());
+
+    RpcPoolRequest *req = new RpcPoolRequest();
+    req -> pool = pool;
+    req -> method = *method_name;
+    req -> cb.reset(new Persistent<Function>(isolate, Local<Function>::Cast(args[3])));
+    req -> timer_open = false;
+    req -> deadline_ms = deadline_ms > 0 ? now + (uint64_t) std::max(deadline_ms, 1.0) : 0;
+    req -> hedge_at_ms = 0;
+    req -> hedge_delay_ms = hedge_ms > 0 ? (uint64_t) std::max(hedge_ms, 1.0) : 0;
+    req -> hedge_percentile = hedge_percentile;
+    req -> waiting = false;
+    req -> wait_until_ms = 0;
+    req -> primary = NULL;
+    req -> attempts = 0;
+    req -> done = false;
+    pool -> pending++;
+
+    if(req -> hedge_delay_ms || req -> hedge_percentile) {
+        for(auto p : target_params) {
+            req -> hedge_params.push_back(ice_rpc_param_clone(p));
+        }
+    }
 
-    ice_owned_string_t v = ice_rpc_param_get_string_to_owned(p);
-    if(v == NULL) {
-        args.GetReturnValue().Set(Null(isolate));
+    if(!c) {
+        req -> waiting = true;
+        req -> wait_until_ms = req -> deadline_ms ? req -> deadline_ms : now + pool -> connect_wait_ms;
+        req -> params.swap(target_params);
+        req -> wait_pos = pool -> waiting.insert(pool -> waiting.end(), req);
+    }
+
+    if(req -> waiting || req -> deadline_ms || !req -> hedge_params.empty()) {
+        uv_timer_init(uv_default_loop(), &req -> timer);
+        req -> timer.data = (void *) req;
+        req -> timer_open = true;
+    }
+
+    if(c) {
+        rpc_pool_request_start(req, c, target_params);
     } else {
-        Local<Value> ret = String::NewFromUtf8(isolate, v);
-        ice_glue_destroy_cstring(v);
-        args.GetReturnValue().Set(ret);
+        rpc_pool_request_arm_timer(req);
     }
 }
 
-static void rpc_param_get_bool(const FunctionCallbackInfo<Value>& args) {
+// Pool-wide counters: {hedgesIssued, hedgesWon, deadlinesExceeded}.
+static void rpc_client_pool_counters(const FunctionCallbackInfo<Value>& args) {
     Isolate *isolate = args.GetIsolate();
+    RpcClientPool *pool = rpc_client_pool_from_object(args[0] -> ToObject());
 
-    NativeResource res = NativeResource::from_object(args[0] -> ToObject());
-    assert(res.get_type() == NR_RpcParam);
-    IceRpcParam p = (IceRpcParam) res.get_data();
+    Local<Object> ret = Object::New(isolate);
+    ret -> Set(String::NewFromUtf8(isolate, "hedgesIssued"), Number::New(isolate, pool -> hedges_issued));
+    ret -> Set(String::NewFromUtf8(isolate, "hedgesWon"), Number::New(isolate, pool -> hedges_won));
+    ret -> Set(String::NewFromUtf8(isolate, "deadlinesExceeded"), Number::New(isolate, pool -> deadlines_exceeded));
 
-    bool v = ice_rpc_param_get_bool(p);
-    args.GetReturnValue().Set(Boolean::New(isolate, v));
+    args.GetReturnValue().Set(ret);
 }
 
-static void rpc_param_get_error(const FunctionCallbackInfo<Value>& args) {
+static void rpc_client_pool_stats(const FunctionCallbackInfo<Value>& args) {
     Isolate *isolate = args.GetIsolate();
+    RpcClientPool *pool = rpc_client_pool_from_object(args[0] -> ToObject());
 
-    NativeResource res = NativeResource::from_object(args[0] -> ToObject());
-    assert(res.get_type() == NR_RpcParam);
-    IceRpcParam p = (IceRpcParam) res.get_data();
+    Local<Array> ret = Array::New(isolate, pool -> endpoints.size());
 
-    IceRpcParam v = ice_rpc_param_get_error(p);
-    if(v == NULL) {
-        args.GetReturnValue().Set(Null(isolate));
-    } else {
-        NativeResource ret(NR_RpcParam, (void *) v);
-        args.GetReturnValue().Set(ret.build_object(isolate));
-    }
-}
+    for(size_t i = 0; i < pool -> endpoints.size(); i++) {
+        RpcPoolEndpoint *e = pool -> endpoints[i].get();
 
-static void rpc_param_is_null(const FunctionCallbackInfo<Value>& args) {
-    Isolate *isolate = args.GetIsolate();
+        unsigned int connected = 0;
+        for(auto& c : e -> conns) {
+            if(c.conn && !c.broken) connected++;
+        }
 
-    NativeResource res = NativeResource::from_object(args[0] -> ToObject());
-    assert(res.get_type() == NR_RpcParam);
-    IceRpcParam p = (IceRpcParam) res.get_data();
+        Local<Object> item = Object::New(isolate);
+        item -> Set(String::NewFromUtf8(isolate, "address"), String::NewFromUtf8(isolate, e -> addr.c_str()));
+        item -> Set(String::NewFromUtf8(isolate, "connected"), Number::New(isolate, connected));
+        item -> Set(String::NewFromUtf8(isolate, "inflight"), Number::New(isolate, e -> inflight));
+        item -> Set(String::NewFromUtf8(isolate, "calls"), Number::New(isolate, e -> calls));
+        item -> Set(String::NewFromUtf8(isolate, "failures"), Number::New(isolate, e -> failures));
+        item -> Set(String::NewFromUtf8(isolate, "avgLatencyMicros"), Number::New(isolate, e -> avg_latency_us));
+
+        // Percentiles of recent successful calls, as used for hedging, or
+        // null while there are too few samples.
+        static const int percentiles[] = { 50, 90, 99 };
+        std::vector<uint32_t>& samples = e -> percentile_scratch;
+        bool have_samples = e -> recent_latency_us.size() >= RPC_POOL_HEDGE_MIN_SAMPLES;
+        if(have_samples) {
+            samples.assign(e -> recent_latency_us.begin(), e -> recent_latency_us.end());
+            std::sort(samples.begin(), samples.end());
+        }
+        for(int pct : percentiles) {
+            std::string key = "p" + std::to_string(pct) + "LatencyMicros";
+            Local<Value> v = Null(isolate);
+            if(have_samples) {
+                size_t k = std::min(samples.size() - 1, samples.size() * pct / 100);
+                v = Number::New(isolate, samples[k]);
+            }
+            item -> Set(String::NewFromUtf8(isolate, key.c_str()), v);
+        }
+        ret -> Set(i, item);
+    }
 
-    bool ret = ice_rpc_param_is_null(p);
-    args.GetReturnValue().Set(Boolean::New(isolate, ret));
+    args.GetReturnValue().Set(ret);
 }
 
-static void rpc_param_destroy(const FunctionCallbackInfo<Value>& args) {
-    Local<Object> arg0 = args[0] -> ToObject();
+static void rpc_client_pool_destroy(const FunctionCallbackInfo<Value>& args) {
+    Local<Object> target = args[0] -> ToObject();
+    RpcClientPool *pool = rpc_client_pool_from_object(target);
 
-    NativeResource res = NativeResource::from_object(arg0);
-    assert(res.get_type() == NR_RpcParam);
-    IceRpcParam p = (IceRpcParam) res.get_data();
+    NativeResource::reset_object(target);
+    rpc_client_pool_close(pool);
+}
 
-    NativeResource::reset_object(arg0);
-    ice_rpc_param_destroy(p);
+static void dispatch_async_event(AsyncEvent *ev) {
+    switch(ev -> kind) {
+        case AE_HttpRoute:
+            dispatch_http_route(ev);
+            break;
+        case AE_HttpBodyData:
+            dispatch_http_body_data(ev);
+            break;
+        case AE_HttpBodyEnd:
+            dispatch_http_body_end(ev);
+            break;
+        case AE_HttpBodyResume:
+            dispatch_http_body_resume(ev);
+            break;
+        case AE_HttpBodyFull:
+            dispatch_http_body_full(ev);
+            break;
+        case AE_HttpRouterMatch:
+            dispatch_http_router_match(ev);
+            break;
+        case AE_RpcMethodCall:
+            dispatch_rpc_method_call(ev);
+            break;
+        case AE_RpcClientConnect:
+            dispatch_rpc_client_connect(ev);
+            break;
+        case AE_RpcCallReturn:
+            dispatch_rpc_call_return(ev);
+            break;
+        case AE_RpcBatchReturn:
+            dispatch_rpc_batch_return(ev);
+            break;
+        case AE_RpcPoolConnect:
+            dispatch_rpc_pool_connect(ev);
+            break;
+        case AE_RpcPoolCallReturn:
+            dispatch_rpc_pool_call_return(ev);
+            break;
+        default:
+            assert(false);
+    }
 }
 
-static void rpc_param_clone(const FunctionCallbackInfo<Value>& args) {
-    Isolate *isolate = args.GetIsolate();
+static void drain_async_events() {
+    unsigned int n_dispatched = 0;
+    uint64_t deadline = 0;
 
-    NativeResource res = NativeResource::from_object(args[0] -> ToObject());
-    assert(res.get_type() == NR_RpcParam);
-    IceRpcParam p = (IceRpcParam) res.get_data();
+    if(dispatch_budget_max_ns) {
+        deadline = uv_hrtime() + dispatch_budget_max_ns;
+    }
+    dispatch_stats.wakeups++;
 
-    IceRpcParam ret = ice_rpc_param_clone(p);
+    while(true) {
+        AsyncEvent *batch = deferred_async_events;
+        deferred_async_events = NULL;
 
-    args.GetReturnValue().Set(
-        NativeResource(NR_RpcParam, (void *) ret).build_object(isolate)
-    );
-}
+        if(batch == NULL) {
+            batch = take_async_events();
+        }
 
-static void rpc_client_create(const FunctionCallbackInfo<Value>& args) {
-    Isolate *isolate = args.GetIsolate();
+        if(batch == NULL) {
+            // A producer that pushed before this store saw the flag set and
+            // did not signal, so check once more before going idle.
+            async_event_notified.store(false);
+            if(async_event_queue.load() == NULL) {
+                break;
+            }
+            async_event_notified.store(true);
+            continue;
+        }
 
-    String::Utf8Value addr(args[0] -> ToString());
-    NativeResource res(
-        NR_RpcClient,
-        (void *) ice_rpc_client_create(*addr)
-    );
+        AsyncEvent *last = NULL;
+        for(AsyncEvent *ev = batch; ev != NULL; ev = ev -> next) {
+            bool over_budget = false;
 
-    args.GetReturnValue().Set(
-        res.build_object(isolate)
-    );
-}
+            if(dispatch_budget_max_events && n_dispatched >= dispatch_budget_max_events) {
+                dispatch_stats.budget_hits_events++;
+                over_budget = true;
+            } else if(deadline && n_dispatched && uv_hrtime() >= deadline) {
+                dispatch_stats.budget_hits_time++;
+                over_budget = true;
+            }
 
-static void rpc_client_destroy(const FunctionCallbackInfo<Value>& args) {
-    Local<Object> arg0 = args[0] -> ToObject();
+            if(over_budget) {
+                // Keep the rest of the batch for the next wakeup and yield
+                // to the loop. The notified flag stays set, so producers
+                // keep skipping uv_async_send until the queue drains.
+                deferred_async_events = ev;
+                if(last) {
+                    AsyncEventPool::release(batch, last);
+                }
+                uv_async_send(&global_async_handle);
+                return;
+            }
 
-    NativeResource res = NativeResource::from_object(arg0);
-    assert(res.get_type() == NR_RpcClient);
+            dispatch_async_event(ev);
+            dispatch_stats.events++;
+            n_dispatched++;
+            last = ev;
+        }
+        AsyncEventPool::release(batch, last);
+    }
+}
 
-    auto client = (IceRpcClient) res.get_data();
-    ice_rpc_client_destroy(client);
+static void handle_async_callback(uv_async_t *async_info) {
+    if(batched_dispatch) {
+        Isolate *isolate = Isolate::GetCurrent();
+        HandleScope scope(isolate);
+        node::CallbackScope callback_scope(isolate, get_callback_receiver(isolate), { 0, 0 });
 
-    NativeResource::reset_object(arg0);
+        drain_async_events();
+    } else {
+        drain_async_events();
+    }
 }
 
-static void rpc_client_connect(const FunctionCallbackInfo<Value>& args) {
+static void native_resource_stats(const FunctionCallbackInfo<Value>& args) {
     Isolate *isolate = args.GetIsolate();
-    NativeResource res = NativeResource::from_object(args[0] -> ToObject());
-    assert(res.get_type() == NR_RpcClient);
-
-    auto client = (IceRpcClient) res.get_data();
-
-    Local<Function> cb = Local<Function>::Cast(args[1]);
-    auto persistent_cb = new Persistent<Function>(isolate, cb);
+    Local<Object> ret = Object::New(isolate);
 
-    ice_rpc_client_connect(
-        client,
-        [](IceRpcClientConnection conn, void *call_with) {
-            auto persistent_cb = (Persistent<Function> *) call_with;
-            enqueue_executor([=]() {
-                Isolate *isolate = Isolate::GetCurrent();
-                HandleScope scope(isolate);
-
-                Local<Function> cb = Local<Function>::New(isolate, *persistent_cb);
-                persistent_cb -> Reset();
-                delete persistent_cb;
-
-                Local<Value> target_conn;
-                
-                if(conn == NULL) {
-                    target_conn = Null(isolate);
-                } else {
-                    target_conn = NativeResource(
-                        NR_RpcClientConnection,
-                        (void *) conn
-                    ).build_object(isolate);
-                }
+    for(int i = NR_Invalid + 1; i < NR_TypeCount; i++) {
+        ret -> Set(
+            String::NewFromUtf8(isolate, native_resource_type_names[i]),
+            Number::New(isolate, native_resource_live_count[i])
+        );
+    }
 
-                Local<Value> argv[] = {
-                    target_conn
-                };
-                node::MakeCallback(
-                    isolate,
-                    Object::New(isolate),
-                    cb,
-                    1,
-                    argv
-                );
-            });
-        },
-        (void *) persistent_cb
-    );
+    args.GetReturnValue().Set(ret);
 }
 
-static void rpc_client_connection_destroy(const FunctionCallbackInfo<Value>& args) {
-    Local<Object> arg0 = args[0] -> ToObject();
-    NativeResource res = NativeResource::from_object(arg0);
-    assert(res.get_type() == NR_RpcClientConnection);
-
-    auto conn = (IceRpcClientConnection) res.get_data();
-    NativeResource::reset_object(arg0);
+static void set_batched_dispatch(const FunctionCallbackInfo<Value>& args) {
+    batched_dispatch = args[0] -> BooleanValue();
+}
 
-    ice_rpc_client_connection_destroy(conn);
+static void set_dispatch_budget(const FunctionCallbackInfo<Value>& args) {
+    dispatch_budget_max_events = (unsigned int) args[0] -> NumberValue();
+    dispatch_budget_max_ns = (uint64_t) (args[1] -> NumberValue() * 1000);
 }
 
-static void rpc_client_connection_call(const FunctionCallbackInfo<Value>& args) {
+static void get_dispatch_stats(const FunctionCallbackInfo<Value>& args) {
     Isolate *isolate = args.GetIsolate();
+    Local<Object> ret = Object::New(isolate);
 
-    Local<Object> arg0 = args[0] -> ToObject();
-    NativeResource res = NativeResource::from_object(arg0);
-    assert(res.get_type() == NR_RpcClientConnection);
+    ret -> Set(String::NewFromUtf8(isolate, "wakeups"), Number::New(isolate, dispatch_stats.wakeups));
+    ret -> Set(String::NewFromUtf8(isolate, "events"), Number::New(isolate, dispatch_stats.events));
+    ret -> Set(String::NewFromUtf8(isolate, "budgetHitsEvents"), Number::New(isolate, dispatch_stats.budget_hits_events));
+    ret -> Set(String::NewFromUtf8(isolate, "budgetHitsTime"), Number::New(isolate, dispatch_stats.budget_hits_time));
 
-    auto conn = (IceRpcClientConnection) res.get_data();
+    args.GetReturnValue().Set(ret);
+}
 
-    String::Utf8Value method_name(args[1] -> ToString());
-    Local<Array> params = Local<Array>::Cast(args[2]);
-    auto paramsLen = params -> Length();
-    std::vector<IceRpcParam> target_params;
+// set_file_cache_limits(maxBytes, maxFileSize). A maxBytes of 0 disables
+// the cache.
+static void set_file_cache_limits(const FunctionCallbackInfo<Value>& args) {
+    file_cache.max_bytes = (size_t) args[0] -> NumberValue();
+    file_cache.max_file_size = (size_t) args[1] -> NumberValue();
 
-    for(unsigned int i = 0; i < paramsLen; i++) {
-        auto paramObj = params -> Get(i) -> ToObject();
-        NativeResource paramRes = NativeResource::from_object(paramObj);
-        assert(paramRes.get_type() == NR_RpcParam);
+    std::lock_guard<std::mutex> lock(file_cache.lock);
+    file_cache.evict_to_fit();
+}
 
-        IceRpcParam p = (IceRpcParam) paramRes.get_data();
-        NativeResource::reset_object(paramObj);
+static void get_file_cache_stats(const FunctionCallbackInfo<Value>& args) {
+    Isolate *isolate = args.GetIsolate();
+    Local<Object> ret = Object::New(isolate);
 
-        target_params.push_back(p);
+    size_t entries, bytes;
+    {
+        std::lock_guard<std::mutex> lock(file_cache.lock);
+        entries = file_cache.index.size();
+        bytes = file_cache.bytes;
     }
 
-    Local<Function> cb = Local<Function>::Cast(args[3]);
-    auto persistent_cb = new Persistent<Function>(isolate, cb);
+    ret -> Set(String::NewFromUtf8(isolate, "hits"), Number::New(isolate, file_cache.hits));
+    ret -> Set(String::NewFromUtf8(isolate, "misses"), Number::New(isolate, file_cache.misses));
+    ret -> Set(String::NewFromUtf8(isolate, "notModified"), Number::New(isolate, file_cache.not_modified));
+    ret -> Set(String::NewFromUtf8(isolate, "evictions"), Number::New(isolate, file_cache.evictions));
+    ret -> Set(String::NewFromUtf8(isolate, "entries"), Number::New(isolate, entries));
+    ret -> Set(String::NewFromUtf8(isolate, "bytes"), Number::New(isolate, bytes));
 
-    ice_rpc_client_connection_call(
-        conn,
-        *method_name,
-        &target_params[0],
-        target_params.size(),
-        [](const IceRpcParam ret_borrowed, void *call_with) {
-            auto persistent_cb = (Persistent<Function> *) call_with;
-            IceRpcParam ret = NULL;
-            if(ret_borrowed) {
-                ret = ice_rpc_param_clone(ret_borrowed);
-            }
-            enqueue_executor([=]() {
-                Isolate *isolate = Isolate::GetCurrent();
-                HandleScope scope(isolate);
-
-                Local<Function> cb = Local<Function>::New(isolate, *persistent_cb);
-                persistent_cb -> Reset();
-                delete persistent_cb;
-
-                Local<Value> targetRet;
-                if(ret == NULL) {
-                    targetRet = Null(isolate);
-                } else {
-                    targetRet = NativeResource(NR_RpcParam, (void *) ret).build_object(isolate);
-                }
-                Local<Value> argv[] = {
-                    targetRet
-                };
-                node::MakeCallback(
-                    isolate,
-                    Object::New(isolate),
-                    cb,
-                    1,
-                    argv
-                );
-            });
-        },
-        (void *) persistent_cb
-    );
+    args.GetReturnValue().Set(ret);
 }
 
 void check_version() {
@@ -1116,6 +4998,12 @@ static void init_module(Local<Object> exports) {
 
     check_version();
 
+    NODE_SET_METHOD(exports, "set_batched_dispatch", set_batched_dispatch);
+    NODE_SET_METHOD(exports, "set_dispatch_budget", set_dispatch_budget);
+    NODE_SET_METHOD(exports, "set_file_cache_limits", set_file_cache_limits);
+    NODE_SET_METHOD(exports, "get_file_cache_stats", get_file_cache_stats);
+    NODE_SET_METHOD(exports, "get_dispatch_stats", get_dispatch_stats);
+    NODE_SET_METHOD(exports, "native_resource_stats", native_resource_stats);
     NODE_SET_METHOD(exports, "http_server_config_create", http_server_config_create);
     NODE_SET_METHOD(exports, "http_server_config_destroy", http_server_config_destroy);
     NODE_SET_METHOD(exports, "http_server_config_set_listen_addr", http_server_config_set_listen_addr);
@@ -1129,7 +5017,26 @@ static void init_module(Local<Object> exports) {
     NODE_SET_METHOD(exports, "http_response_create", http_response_create);
     NODE_SET_METHOD(exports, "http_response_destroy", http_response_destroy);
     NODE_SET_METHOD(exports, "http_response_set_body", http_response_set_body);
+    NODE_SET_METHOD(exports, "http_response_set_body_v", http_response_set_body_v);
+    NODE_SET_METHOD(exports, "http_response_apply", http_response_apply);
+    NODE_SET_METHOD(exports, "http_respond", http_respond);
+    NODE_SET_METHOD(exports, "http_router_create", http_router_create);
+    NODE_SET_METHOD(exports, "http_router_add", http_router_add);
+    NODE_SET_METHOD(exports, "http_router_add_template", http_router_add_template);
+    NODE_SET_METHOD(exports, "http_router_add_redirect", http_router_add_redirect);
+    NODE_SET_METHOD(exports, "http_router_add_file", http_router_add_file);
+    NODE_SET_METHOD(exports, "http_router_add_directory", http_router_add_directory);
+    NODE_SET_METHOD(exports, "http_router_add_fallback_prefix", http_router_add_fallback_prefix);
+    NODE_SET_METHOD(exports, "http_router_set_fallback", http_router_set_fallback);
+    NODE_SET_METHOD(exports, "http_server_set_router", http_server_set_router);
+    NODE_SET_METHOD(exports, "http_header_set_create", http_header_set_create);
+    NODE_SET_METHOD(exports, "http_response_template_create", http_response_template_create);
+    NODE_SET_METHOD(exports, "http_respond_template", http_respond_template);
     NODE_SET_METHOD(exports, "http_response_set_status", http_response_set_status);
+    NODE_SET_METHOD(exports, "http_response_body_writer_create", http_response_body_writer_create);
+    NODE_SET_METHOD(exports, "http_response_body_writer_write", http_response_body_writer_write);
+    NODE_SET_METHOD(exports, "http_response_body_writer_finish", http_response_body_writer_finish);
+    NODE_SET_METHOD(exports, "http_response_body_writer_destroy", http_response_body_writer_destroy);
     NODE_SET_METHOD(exports, "http_response_set_header", http_response_set_header);
     NODE_SET_METHOD(exports, "http_response_append_header", http_response_append_header);
     NODE_SET_METHOD(exports, "http_server_endpoint_context_end_with_response", http_server_endpoint_context_end_with_response);
@@ -1137,10 +5044,15 @@ static void init_module(Local<Object> exports) {
     NODE_SET_METHOD(exports, "http_request_get_method", http_request_get_method);
     NODE_SET_METHOD(exports, "http_request_get_remote_addr", http_request_get_remote_addr);
     NODE_SET_METHOD(exports, "http_request_get_header", http_request_get_header);
+    NODE_SET_METHOD(exports, "http_request_get_headers", http_request_get_headers);
     NODE_SET_METHOD(exports, "storage_file_http_response_begin_send", storage_file_http_response_begin_send);
     NODE_SET_METHOD(exports, "http_server_endpoint_context_take_request", http_server_endpoint_context_take_request);
     NODE_SET_METHOD(exports, "http_request_destroy", http_request_destroy);
     NODE_SET_METHOD(exports, "http_request_take_and_read_body", http_request_take_and_read_body);
+    NODE_SET_METHOD(exports, "http_request_read_full_body", http_request_read_full_body);
+    NODE_SET_METHOD(exports, "http_body_stream_hold", http_body_stream_hold);
+    NODE_SET_METHOD(exports, "http_body_stream_resume", http_body_stream_resume);
+    NODE_SET_METHOD(exports, "http_body_stream_abort", http_body_stream_abort);
     NODE_SET_METHOD(exports, "rpc_server_config_create", rpc_server_config_create);
     NODE_SET_METHOD(exports, "rpc_server_config_destroy", rpc_server_config_destroy);
     NODE_SET_METHOD(exports, "rpc_server_config_add_method", rpc_server_config_add_method);
@@ -1149,12 +5061,17 @@ static void init_module(Local<Object> exports) {
     NODE_SET_METHOD(exports, "rpc_call_context_get_num_params", rpc_call_context_get_num_params);
     NODE_SET_METHOD(exports, "rpc_call_context_get_param", rpc_call_context_get_param);
     NODE_SET_METHOD(exports, "rpc_call_context_end", rpc_call_context_end);
+    NODE_SET_METHOD(exports, "rpc_call_context_get_params_as_js", rpc_call_context_get_params_as_js);
+    NODE_SET_METHOD(exports, "rpc_call_context_end_with_js", rpc_call_context_end_with_js);
     NODE_SET_METHOD(exports, "rpc_param_build_i32", rpc_param_build_i32);
     NODE_SET_METHOD(exports, "rpc_param_build_f64", rpc_param_build_f64);
     NODE_SET_METHOD(exports, "rpc_param_build_string", rpc_param_build_string);
     NODE_SET_METHOD(exports, "rpc_param_build_error", rpc_param_build_error);
     NODE_SET_METHOD(exports, "rpc_param_build_bool", rpc_param_build_bool);
     NODE_SET_METHOD(exports, "rpc_param_build_null", rpc_param_build_null);
+    NODE_SET_METHOD(exports, "rpc_param_build_bytes", rpc_param_build_bytes);
+    NODE_SET_METHOD(exports, "rpc_param_get_bytes", rpc_param_get_bytes);
+    NODE_SET_METHOD(exports, "rpc_param_get_float64_array", rpc_param_get_float64_array);
     NODE_SET_METHOD(exports, "rpc_param_get_i32", rpc_param_get_i32);
     NODE_SET_METHOD(exports, "rpc_param_get_f64", rpc_param_get_f64);
     NODE_SET_METHOD(exports, "rpc_param_get_string", rpc_param_get_string);
@@ -1168,6 +5085,14 @@ static void init_module(Local<Object> exports) {
     NODE_SET_METHOD(exports, "rpc_client_connect", rpc_client_connect);
     NODE_SET_METHOD(exports, "rpc_client_connection_destroy", rpc_client_connection_destroy);
     NODE_SET_METHOD(exports, "rpc_client_connection_call", rpc_client_connection_call);
+    NODE_SET_METHOD(exports, "rpc_client_connection_call_many", rpc_client_connection_call_many);
+    NODE_SET_METHOD(exports, "rpc_prepared_call_create", rpc_prepared_call_create);
+    NODE_SET_METHOD(exports, "rpc_client_pool_create", rpc_client_pool_create);
+    NODE_SET_METHOD(exports, "rpc_client_pool_call", rpc_client_pool_call);
+    NODE_SET_METHOD(exports, "rpc_client_pool_stats", rpc_client_pool_stats);
+    NODE_SET_METHOD(exports, "rpc_client_pool_counters", rpc_client_pool_counters);
+    NODE_SET_METHOD(exports, "rpc_client_pool_destroy", rpc_client_pool_destroy);
+    NODE_SET_METHOD(exports, "rpc_prepared_call_invoke", rpc_prepared_call_invoke);
     //NODE_SET_METHOD(exports, , );
 }
 
@@ -0,0 +1,23 @@
+const core = require("./build/Release/ice_node_v4_core");
+
+// Measures how fast native resources can be wrapped for JS, using the
+// cheapest create/destroy pair the core offers.
+function benchWrappers(n) {
+    let start = process.hrtime();
+
+    for(let i = 0; i < n; i++) {
+        let resp = core.http_response_create();
+        core.http_response_destroy(resp);
+    }
+
+    let t = process.hrtime(start);
+    return n / (t[0] + t[1] / 1e9);
+}
+
+benchWrappers(100000);
+
+for(let i = 0; i < 5; i++) {
+    console.log("wrappers/s: " + Math.round(benchWrappers(1000000)));
+}
+
+process.exit(0);
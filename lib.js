@@ -1,11 +1,14 @@
 const core = require("./build/Release/ice_node_v4_core");
 const assert = require("assert");
+const stream = require("stream");
 const router = require("./router.js");
 const rpc = require("./rpc.js");
 
 module.exports.router = router;
 module.exports.rpc = rpc;
 
+const DEFAULT_BODY_LIMIT = 1048576;
+
 class HttpServer {
     constructor(cfg) {
         assert((cfg instanceof HttpServerConfig) && cfg.inst);
@@ -22,20 +25,113 @@ class HttpServer {
     }
 
     route(path, target) {
-        let rt = core.http_server_route_create(path, function (ctx, rawReq) {
-            let req = new HttpRequest(ctx, rawReq);
+        let rt = core.http_server_route_create(path, function (ctx, rawReq, method, uri, remoteAddr) {
+            let req = new HttpRequest(ctx, rawReq, method, uri, remoteAddr);
             target(req);
         });
         core.http_server_add_route(this.inst, rt);
     }
 
     routeDefault(target) {
-        let rt = core.http_server_route_create("", function (ctx, rawReq) {
-            let req = new HttpRequest(ctx, rawReq);
+        let rt = core.http_server_route_create("", function (ctx, rawReq, method, uri, remoteAddr) {
+            let req = new HttpRequest(ctx, rawReq, method, uri, remoteAddr);
             target(req);
         });
         core.http_server_set_default_route(this.inst, rt);
     }
+
+    // Installs an HttpRouteTable as the default route. Requests are matched
+    // natively. Unmatched ones are answered with 404/405 without entering
+    // JS, unless they fall under one of the table's fallback prefixes.
+    setRouteTable(table) {
+        assert((table instanceof HttpRouteTable) && table.inst);
+        core.http_server_set_router(this.inst, table.inst);
+        table.inst = null;
+    }
+}
+
+function wrap_route_target(target) {
+    return function (ctx, rawReq, method, uri, remoteAddr, params, unmatchedStatus, allow) {
+        let req = new HttpRequest(ctx, rawReq, method, uri, remoteAddr, params);
+        target(req, unmatchedStatus, allow);
+    };
+}
+
+// Paths may contain ":name" segments, which match any single segment, and
+// end with "*name" (or "*"), which matches the rest of the path. Captures
+// are available as `req.params`.
+class HttpRouteTable {
+    constructor() {
+        this.inst = core.http_router_create();
+    }
+
+    add(method, path, target) {
+        assert(this.inst);
+        assert(typeof(method) == "string" && typeof(path) == "string");
+        assert(typeof(target) == "function");
+
+        if(!core.http_router_add(this.inst, method.toUpperCase(), path, wrap_route_target(target))) {
+            throw new Error("Invalid route path: " + path);
+        }
+        return this;
+    }
+
+    // The add* methods below register routes answered entirely on the
+    // executor threads, without entering JS.
+
+    addTemplate(method, path, template) {
+        assert(this.inst);
+        assert(template instanceof HttpResponseTemplate);
+        return this._addNative(core.http_router_add_template, method, path, template.inst);
+    }
+
+    addRedirect(method, path, location, status) {
+        assert(this.inst);
+        assert(typeof(location) == "string");
+        return this._addNative(core.http_router_add_redirect, method, path, location, status || 302);
+    }
+
+    addFile(method, path, filePath) {
+        assert(this.inst);
+        assert(typeof(filePath) == "string");
+        return this._addNative(core.http_router_add_file, method, path, filePath);
+    }
+
+    // `path` must end with a wildcard segment, which names the file to
+    // serve from `dirPath`, which must exist. Paths containing "." or ".."
+    // segments, and files that resolve to outside of `dirPath` through
+    // symlinks, are answered with 404.
+    addDirectory(method, path, dirPath) {
+        assert(this.inst);
+        assert(typeof(dirPath) == "string");
+        return this._addNative(core.http_router_add_directory, method, path, dirPath);
+    }
+
+    _addNative(fn, method, path, ...args) {
+        assert(typeof(method) == "string" && typeof(path) == "string");
+        if(!fn(this.inst, method.toUpperCase(), path, ...args)) {
+            throw new Error("Invalid route path: " + path);
+        }
+        return this;
+    }
+
+    // Unmatched requests under `prefix` go to the fallback target instead
+    // of being answered natively. The target gets the request, the status
+    // (404 or 405) it would have been answered with and, for 405, the
+    // value of the Allow header.
+    addFallbackPrefix(prefix) {
+        assert(this.inst);
+        assert(typeof(prefix) == "string");
+        core.http_router_add_fallback_prefix(this.inst, prefix);
+        return this;
+    }
+
+    setFallback(target) {
+        assert(this.inst);
+        assert(typeof(target) == "function");
+        core.http_router_set_fallback(this.inst, wrap_route_target(target));
+        return this;
+    }
 }
 
 class HttpServerConfig {
@@ -65,13 +161,16 @@ class HttpServerConfig {
 }
 
 class HttpRequest {
-    constructor(ctx, req) {
+    constructor(ctx, req, method, uri, remoteAddr, params) {
         this.ctx = ctx;
         this.inst = req;
+        this.params = params || {};
+        this.responded = false;
         this._cache = {
-            uri: null,
-            method: null,
-            remoteAddr: null
+            uri: uri || null,
+            method: method || null,
+            remoteAddr: remoteAddr || null,
+            headers: null
         };
     }
 
@@ -79,33 +178,149 @@ class HttpRequest {
         return new HttpResponse(this.ctx, this);
     }
 
-    intoBody(onData, onEnd) {
+    // Reads the request body. Calling hold() on the returned stream holds
+    // back delivery to onData until resume(). The body keeps being read in
+    // the meantime, so held data is buffered in memory. If
+    // `options.maxBuffered` is set and more than that many bytes are waiting
+    // for JS, the read fails and onEnd gets false. By default there is no
+    // limit.
+    intoBody(onData, onEnd, options) {
         assert(this.inst);
+        options = options || {};
+
         let ownedInst = core.http_server_endpoint_context_take_request(this.ctx);
         this.inst = null;
 
-        core.http_request_take_and_read_body(ownedInst, onData, onEnd);
+        return new HttpBodyStream(core.http_request_take_and_read_body(
+            ownedInst,
+            onData,
+            onEnd,
+            options.maxBuffered || 0
+        ));
+    }
+
+    // Reads the whole body into a single Buffer. Rejects with an error whose
+    // `status` is 413 if the body is larger than `limit` bytes.
+    body(limit) {
+        assert(this.inst);
+        if(limit === undefined) {
+            limit = DEFAULT_BODY_LIMIT;
+        }
+        assert(typeof(limit) == "number" && limit >= 0);
+
+        let ownedInst = core.http_server_endpoint_context_take_request(this.ctx);
+        this.inst = null;
+
+        return new Promise((resolve, reject) => {
+            core.http_request_read_full_body(ownedInst, limit, (err, data) => {
+                if(err) {
+                    reject(err);
+                } else {
+                    resolve(data);
+                }
+            });
+        });
+    }
+
+    // Returns the body as a stream.Readable. Delivery is held while the
+    // readable is full, and `options.maxBuffered` applies as for intoBody.
+    intoReadable(options) {
+        options = options || {};
+        let highWaterMark = options.highWaterMark || 65536;
+
+        let readable = new HttpBodyReadable({ highWaterMark: highWaterMark });
+        readable._body = this.intoBody((data) => {
+            if(readable.destroyed) {
+                return false;
+            }
+            if(!readable.push(data)) {
+                readable._body.hold();
+            }
+            return true;
+        }, (ok) => {
+            if(readable.destroyed) {
+                return;
+            }
+            if(ok) {
+                readable.push(null);
+            } else {
+                readable.destroy(new Error("Request body read failed"));
+            }
+        }, { maxBuffered: options.maxBuffered || 0 });
+
+        return readable;
     }
 
     getMethod() {
+        if(this._cache.method) {
+            return this._cache.method;
+        }
         assert(this.inst);
         return core.http_request_get_method(this.inst);
     }
 
     getUri() {
+        if(this._cache.uri) {
+            return this._cache.uri;
+        }
         assert(this.inst);
         return core.http_request_get_uri(this.inst);
     }
 
     getRemoteAddr() {
+        if(this._cache.remoteAddr) {
+            return this._cache.remoteAddr;
+        }
         assert(this.inst);
         return core.http_request_get_remote_addr(this.inst);
     }
 
     getHeader(k) {
-        assert(this.inst);
         assert(typeof(k) == "string");
-        return core.http_request_get_header(this.inst, k);
+
+        let headers = this._headerCache();
+        let key = k.toLowerCase();
+
+        if(key in headers) {
+            return headers[key];
+        }
+
+        assert(this.inst);
+        return (headers[key] = core.http_request_get_header(this.inst, k));
+    }
+
+    // Looks up several headers with a single native call. Returns an object
+    // keyed by the names as given; missing headers map to null.
+    getHeaders(keys) {
+        assert(Array.isArray(keys));
+
+        let headers = this._headerCache();
+        let missing = [];
+
+        for(const k of keys) {
+            assert(typeof(k) == "string");
+            if(!(k.toLowerCase() in headers)) {
+                missing.push(k);
+            }
+        }
+
+        if(missing.length) {
+            assert(this.inst);
+            let values = core.http_request_get_headers(this.inst, missing);
+            for(let i = 0; i < missing.length; i++) {
+                headers[missing[i].toLowerCase()] = values[i];
+            }
+        }
+
+        let ret = {};
+        for(const k of keys) {
+            ret[k] = headers[k.toLowerCase()];
+        }
+        return ret;
+    }
+
+    _headerCache() {
+        return (this._cache.headers || (this._cache.headers = Object.create(null)));
     }
 
     get uri() {
@@ -121,80 +336,333 @@ class HttpRequest {
     }
 }
 
+class HttpBodyStream {
+    constructor(inst) {
+        this.inst = inst;
+    }
+
+    hold() {
+        core.http_body_stream_hold(this.inst);
+    }
+
+    resume() {
+        core.http_body_stream_resume(this.inst);
+    }
+
+    abort() {
+        core.http_body_stream_abort(this.inst);
+    }
+}
+
+class HttpBodyReadable extends stream.Readable {
+    _read() {
+        if(this._body) {
+            this._body.resume();
+        }
+    }
+
+    _destroy(err, cb) {
+        if(this._body) {
+            this._body.abort();
+        }
+        cb(err);
+    }
+}
+
+// Status, headers and body are kept in JS and sent with a single native
+// call. A native response object is only created for operations that need
+// one (sending a file or streaming a body).
 class HttpResponse {
     constructor(ctx, req) {
         this.ctx = ctx;
         this.req = req;
-        this.inst = core.http_response_create();
-        core.http_response_set_header(this.inst, "X-Powered-By", "Ice-node");
+        this.inst = null;
+        this._open = true;
+        this._status = 0;
+        this._headers = ["X-Powered-By", "Ice-node"];
+        this._headerSets = null;
+        this._body = null;
     }
 
     destroy() {
-        assert(this.inst);
-        core.http_response_destroy(this.inst);
-        this.inst = null;
+        assert(this._open);
+        if(this.inst) {
+            core.http_response_destroy(this.inst);
+            this.inst = null;
+        }
+        this._open = false;
     }
 
     send() {
-        assert(this.inst);
-        core.http_server_endpoint_context_end_with_response(this.ctx, this.inst);
-        this.inst = null;
+        assert(this._open);
+        if(this.inst) {
+            core.http_response_apply(this.inst, 0, this._headers, null, this._headerSets);
+            core.http_server_endpoint_context_end_with_response(this.ctx, this.inst);
+            this.inst = null;
+        } else {
+            core.http_respond(this.ctx, this._status, this._headers, this._body, this._headerSets);
+        }
+        this._open = false;
+        this.req.responded = true;
     }
 
     setBody(data) {
-        assert(this.inst);
+        assert(this._open);
 
-        if(!(data instanceof Buffer)) {
+        if(typeof(data) != "string" && !(data instanceof Buffer)) {
             data = Buffer.from(data);
         }
         assert(data);
 
-        core.http_response_set_body(this.inst, data);
+        if(this.inst) {
+            core.http_response_set_body(this.inst, data);
+        } else {
+            this._body = data;
+        }
+
+        return this;
+    }
+
+    // Sets the body to the concatenation of a list of Buffers and strings.
+    setBodyv(parts) {
+        assert(this._open);
+        assert(Array.isArray(parts));
+
+        parts = parts.map(p => (typeof(p) == "string" || p instanceof Buffer) ? p : Buffer.from(p));
+
+        if(this.inst) {
+            core.http_response_set_body_v(this.inst, parts);
+        } else {
+            this._body = parts;
+        }
 
         return this;
     }
 
     setStatus(status) {
-        assert(this.inst);
+        assert(this._open);
         assert(typeof(status) == "number");
 
-        core.http_response_set_status(this.inst, status);
+        if(this.inst) {
+            core.http_response_set_status(this.inst, status);
+        } else {
+            this._status = status;
+        }
 
         return this;
     }
 
     setHeader(k, v) {
-        assert(this.inst);
+        assert(this._open);
         assert(typeof(k) == "string" && typeof(v) == "string");
 
-        core.http_response_set_header(this.inst, k, v);
+        let key = k.toLowerCase();
+        let headers = this._headers;
+        for(let i = 0; i < headers.length; i += 2) {
+            if(headers[i].toLowerCase() == key) {
+                headers.splice(i, 2);
+                i -= 2;
+            }
+        }
+        headers.push(k, v);
 
         return this;
     }
 
     appendHeader(k, v) {
-        assert(this.inst);
+        assert(this._open);
         assert(typeof(k) == "string" && typeof(v) == "string");
 
-        core.http_response_append_header(this.inst, k, v);
+        this._headers.push(k, v);
+        return this;
+    }
+
+    // Attaches a shared HttpHeaderSet. Headers set on the response itself
+    // take precedence over those from the set, whatever the call order.
+    useHeaders(set) {
+        assert(this._open);
+        assert(set instanceof HttpHeaderSet);
 
+        (this._headerSets || (this._headerSets = [])).push(set.inst);
         return this;
     }
 
+    // Returns a stream.Writable that accumulates the body off the JS heap,
+    // for bodies generated piece by piece. This is not a streamed response:
+    // nothing is sent until the writer ends, and the core then copies the
+    // accumulated body once more.
+    createBodyAccumulator() {
+        assert(this._open);
+        return new HttpResponseBodyAccumulator(this);
+    }
+
     sendFile(path) {
-        assert(this.inst && this.req.inst);
+        assert(this._open && this.req.inst);
         assert(typeof(path) == "string");
 
-        let ret = core.storage_file_http_response_begin_send(this.req.inst, this.inst, path);
+        let ret = core.storage_file_http_response_begin_send(this.req.inst, this._native(), path);
         if(!ret) {
             throw new Error("Unable to send file: " + path);
         }
 
         return this;
     }
+
+    // Creates the native response from the status and body accumulated so
+    // far. Headers and header sets are still merged once, at send time.
+    _native() {
+        if(!this.inst) {
+            this.inst = core.http_response_create();
+            core.http_response_apply(this.inst, this._status, null, this._body, null);
+            this._body = null;
+        }
+        return this.inst;
+    }
+}
+
+function flatten_headers(headers) {
+    if(Array.isArray(headers)) {
+        return headers;
+    }
+
+    let flat = [];
+    for(const k in headers) {
+        assert(typeof(headers[k]) == "string");
+        flat.push(k, headers[k]);
+    }
+    return flat;
+}
+
+// A block of headers stored natively, to be attached to many responses.
+class HttpHeaderSet {
+    constructor(headers) {
+        assert(headers && typeof(headers) == "object");
+        this.inst = core.http_header_set_create(flatten_headers(headers));
+    }
+}
+
+// An immutable response built once and sent any number of times.
+// `options` may contain `status`, `headers`, `headerSets` and `body`.
+class HttpResponseTemplate {
+    constructor(options) {
+        options = options || {};
+
+        let headers = ["X-Powered-By", "Ice-node"].concat(flatten_headers(options.headers || []));
+        let headerSets = (options.headerSets || []).map(v => {
+            assert(v instanceof HttpHeaderSet);
+            return v.inst;
+        });
+
+        let body = options.body;
+        if(body !== undefined && typeof(body) != "string" && !(body instanceof Buffer)) {
+            body = Buffer.from(body);
+        }
+
+        this.inst = core.http_response_template_create(
+            options.status || 200,
+            headers,
+            body,
+            headerSets
+        );
+    }
+
+    sendTo(req) {
+        assert(req instanceof HttpRequest && !req.responded);
+        core.http_respond_template(req.ctx, this.inst);
+        req.responded = true;
+    }
+}
+
+class HttpResponseBodyAccumulator extends stream.Writable {
+    constructor(resp) {
+        super({ decodeStrings: false });
+        this.resp = resp;
+        this.inst = core.http_response_body_writer_create();
+    }
+
+    _write(chunk, encoding, cb) {
+        if(typeof(chunk) == "string" && encoding != "utf8" && encoding != "utf-8") {
+            chunk = Buffer.from(chunk, encoding);
+        }
+        core.http_response_body_writer_write(this.inst, chunk);
+        cb();
+    }
+
+    _final(cb) {
+        core.http_response_body_writer_finish(this.inst, this.resp._native());
+        this.inst = null;
+        this.resp.send();
+        cb();
+    }
+
+    _destroy(err, cb) {
+        if(this.inst) {
+            core.http_response_body_writer_destroy(this.inst);
+            this.inst = null;
+        }
+        cb(err);
+    }
+}
+
+// Run all callbacks delivered in one wakeup of the event loop under a single
+// callback scope, so that microtasks and nextTicks are processed once per
+// batch rather than after every callback.
+function setBatchedDispatch(enabled) {
+    assert(enabled === true || enabled === false);
+    core.set_batched_dispatch(enabled);
+}
+
+// Limit how much native callback work is done per event loop wakeup, so
+// that timers and other I/O are not starved under sustained load. Either
+// limit may be 0 to disable it.
+function setDispatchBudget(maxEvents, maxMicros) {
+    assert(typeof(maxEvents) == "number" && maxEvents >= 0);
+    assert(typeof(maxMicros) == "number" && maxMicros >= 0);
+    core.set_dispatch_budget(maxEvents, maxMicros);
+}
+
+function getDispatchStats() {
+    return core.get_dispatch_stats();
+}
+
+// Number of native objects currently owned by JS wrappers, per type.
+// Objects that are neither destroyed nor handed over are released when
+// their wrapper is garbage collected.
+function nativeResourceStats() {
+    return core.native_resource_stats();
+}
+
+// Serve files sent with sendFile() or native file routes from an in-memory
+// LRU cache of up to `maxBytes`, holding files up to `maxFileSize` bytes
+// each. Responses carry ETag and Last-Modified, and conditional requests
+// are answered with 304. A `maxBytes` of 0 disables the cache.
+function configureFileCache(options) {
+    assert(options && typeof(options.maxBytes) == "number" && options.maxBytes >= 0);
+
+    let maxFileSize = options.maxFileSize;
+    if(maxFileSize === undefined) {
+        maxFileSize = options.maxBytes;
+    }
+    assert(typeof(maxFileSize) == "number" && maxFileSize >= 0);
+
+    core.set_file_cache_limits(options.maxBytes, maxFileSize);
+}
+
+function getFileCacheStats() {
+    return core.get_file_cache_stats();
 }
 
+module.exports.setBatchedDispatch = setBatchedDispatch;
+module.exports.setDispatchBudget = setDispatchBudget;
+module.exports.getDispatchStats = getDispatchStats;
+module.exports.nativeResourceStats = nativeResourceStats;
+module.exports.configureFileCache = configureFileCache;
+module.exports.getFileCacheStats = getFileCacheStats;
 module.exports.HttpServer = HttpServer;
 module.exports.HttpServerConfig = HttpServerConfig;
+module.exports.HttpRouteTable = HttpRouteTable;
 module.exports.HttpRequest = HttpRequest;
+module.exports.HttpBodyStream = HttpBodyStream;
 module.exports.HttpResponse = HttpResponse;
+module.exports.HttpHeaderSet = HttpHeaderSet;
+module.exports.HttpResponseTemplate = HttpResponseTemplate;
@@ -1,16 +1,39 @@
 const lib = require("./lib.js");
 const router = lib.router;
+const assert = require("assert");
+const core = require("./build/Release/ice_node_v4_core");
 
 let server = new lib.HttpServer(
     new lib.HttpServerConfig().setNumExecutors(4).setListenAddr("127.0.0.1:6851")
 );
 
+lib.configureFileCache({ maxBytes: 16 * 1048576, maxFileSize: 1048576 });
+
 let rt = new router.Router();
 
 rt.use("/info/", (req) => {
     req.mwHit = true;
 });
 
+rt.use("/async/", async (req) => {
+    await new Promise(cb => setImmediate(cb));
+    req.mwHit = true;
+});
+
+// Unmatched requests under a middleware prefix still go through it.
+rt.use("/guarded/", (req) => {
+    if(req.getHeader("Authorization") === null) {
+        throw req.createResponse().setStatus(401);
+    }
+});
+rt.route("GET", "/guarded/data", (req) => {
+    return "data\n";
+});
+
+rt.route("GET", "/async/check", (req) => {
+    return req.mwHit ? "OK\n" : "Middleware not awaited\n";
+});
+
 rt.route("GET", "/info/uri", (req) => {
     if(!req.mwHit) {
         throw new Error("Middleware not called");
@@ -19,6 +42,15 @@ rt.route("GET", "/info/uri", (req) => {
     return req.uri;
 });
 
+rt.route("GET", "/info/headers", (req) => {
+    let headers = req.getHeaders(["Host", "User-Agent", "X-Not-Present"]);
+    if(headers["X-Not-Present"] !== null || req.getHeader("host") !== headers.Host) {
+        throw new Error("Inconsistent header lookup");
+    }
+
+    return JSON.stringify(headers);
+});
+
 rt.route("POST", "/echo", (req) => {
     let result = [];
 
@@ -31,12 +63,145 @@ rt.route("POST", "/echo", (req) => {
 
     return new router.Detached();
 });
+rt.route("POST", "/echo_stream", (req) => {
+    (async () => {
+        let result = [];
+        for await (const data of req.intoReadable({ highWaterMark: 16384 })) {
+            result.push(data);
+        }
+        req.createResponse().setBody(Buffer.concat(result)).send();
+    })();
+
+    return new router.Detached();
+});
+rt.route("POST", "/echo_slow", (req) => {
+    // A paused, slow consumer must still get the whole body, however large.
+    let readable = req.intoReadable({ highWaterMark: 1024 });
+    readable.pause();
+
+    (async () => {
+        await new Promise(cb => setTimeout(cb, 200));
+
+        let result = [];
+        for await (const data of readable) {
+            result.push(data);
+            if(result.length % 64 == 0) {
+                await new Promise(cb => setTimeout(cb, 1));
+            }
+        }
+        req.createResponse().setBody(Buffer.concat(result)).send();
+    })();
+
+    return new router.Detached();
+});
+rt.route("GET", "/double_send", (req) => {
+    // Returning a response that was already sent must not take down the server.
+    let resp = req.createResponse().setBody("Sent once\n");
+    resp.send();
+    return resp;
+});
+rt.route("POST", "/stalled_body", (req) => {
+    // Never read; the body read must fail at the bound instead of stalling.
+    let readable = req.intoReadable({ highWaterMark: 1024, maxBuffered: 65536 });
+    readable.on("error", (e) => {
+        req.createResponse().setStatus(413).setBody(e.message + "\n").send();
+    });
+    readable.pause();
+
+    return new router.Detached();
+});
+rt.route("POST", "/echo_full", (req) => {
+    req.body(4 * 1048576).then((data) => {
+        req.createResponse().setBody(data).send();
+    }, (e) => {
+        req.createResponse().setStatus(e.status || 500).setBody(e.message + "\n").send();
+    });
+
+    return new router.Detached();
+});
+rt.route("GET", "/accumulated", (req) => {
+    let out = req.createResponse().setHeader("Content-Type", "text/csv").createBodyAccumulator();
+    for(let i = 0; i < 1000; i++) {
+        out.write(i + ",Grüße," + (i * i) + "\n");
+    }
+    let inst = out.inst;
+    out.end(Buffer.from("end\n"), () => {
+        // The writer is gone once finished.
+        assert.throws(() => core.http_response_body_writer_finish(inst, null), /already finished/);
+        assert.throws(() => core.http_response_body_writer_destroy(inst), /already finished/);
+    });
+
+    return new router.Detached();
+});
+rt.route("GET", "/bad_part", (req) => {
+    // Parts that are neither strings nor Buffers are rejected, not read.
+    assert.throws(() => core.http_respond(req.ctx, 200, [], ["ok", 5], []), TypeError);
+    assert.throws(() => core.http_respond(req.ctx, 200, [], [{ length: 1 << 30 }], []), TypeError);
+    assert.throws(() => req.createResponse().setBodyv(["ok", 5]), TypeError);
+
+    return req.createResponse().setBody("Rejected\n");
+});
+// Shared across requests; setBodyv must not convert its entries in place.
+const helloParts = ["Hello", new Uint8Array([32]), "wörld!\n"];
+rt.route("GET", "/hello_parts", (req) => {
+    let resp = req.createResponse()
+        .setHeader("x-powered-by", "lib_test")
+        .appendHeader("X-Part", "1")
+        .appendHeader("X-Part", "2")
+        .setBodyv(helloParts);
+    assert(!Buffer.isBuffer(helloParts[1]));
+    return resp;
+});
+const corsHeaders = new lib.HttpHeaderSet({
+    "Access-Control-Allow-Origin": "*",
+    "Access-Control-Allow-Methods": "GET, POST"
+});
+const helloTemplate = new lib.HttpResponseTemplate({
+    headers: { "Content-Type": "text/plain" },
+    headerSets: [corsHeaders],
+    body: "Hello world!\n"
+});
+rt.route("GET", "/hello_template", (req) => {
+    return helloTemplate;
+});
+rt.route("GET", "/hello_cors", (req) => {
+    return req.createResponse()
+        .useHeaders(corsHeaders)
+        .setHeader("Access-Control-Allow-Origin", "example.com")
+        .setBody("Hello world!\n");
+});
+rt.route("GET", "/users/:id/posts/:post", (req) => {
+    return JSON.stringify(req.params);
+});
+rt.route("GET", "/users/me", (req) => {
+    return "me\n";
+});
+rt.route("POST", "/users/:id", (req) => {
+    return "user " + req.params.id + "\n";
+});
+rt.route("GET", "/files/*path", (req) => {
+    return req.params.path;
+});
 rt.route("GET", "/hello_world", (req) => {
     return req.createResponse().setBody("Hello world!\n");
 });
 rt.route("GET", "/some_file", (req) => {
     return req.createResponse().sendFile("lib_test.js");
 });
+rt.route("GET", "/some_file_cors", (req) => {
+    // Headers set on the response win over sets, whatever the order.
+    return req.createResponse()
+        .sendFile("lib_test.js")
+        .useHeaders(corsHeaders)
+        .setHeader("Access-Control-Allow-Origin", "example.com");
+});
+rt.route("GET", "/native/hello", router.staticResponse(helloTemplate));
+rt.route("GET", "/native/old", router.redirect("/native/hello", 301));
+rt.route("GET", "/native/file", router.file("lib_test.js"));
+rt.route("GET", "/native/dir/*", router.directory("test_static"));
+rt.route("GET", "/file_cache_stats", (req) => {
+    return JSON.stringify(lib.getFileCacheStats());
+});
 rt.route("GET", "/delay", (req) => new Promise(cb => setTimeout(() => cb(
     req.createResponse().setBody("OK")
 ), 1000)));
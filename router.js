@@ -10,26 +10,41 @@ class Router {
     build(server) {
         assert(server instanceof lib.HttpServer);
 
+        let table = new lib.HttpRouteTable();
+
         for(const k in this.endpoints) {
             let ep = this.endpoints[k];
             let mws = this.middlewares.filter(v => ep.path.startsWith(v.path));
-            let target = build_target(ep, mws);
-
-            server.route(ep.path, target);
-        }
-
-        server.routeDefault(async (req) => {
-            let reqUri = req.getUri();
 
-            if(!(await call_middlewares(
-                this.middlewares.filter(v => reqUri.startsWith(v.path)),
-                req
-            ))) {
-                return;
+            for(const method in ep.methodTargets) {
+                let target = ep.methodTargets[method];
+                if(target instanceof NativeRoute) {
+                    target.install(table, method, ep.path);
+                } else {
+                    table.add(method, ep.path, build_target(target, mws));
+                }
             }
+        }
 
-            req.createResponse().setStatus(404).setBody("Not found\n").send();
+        // Middlewares still see 404s and 405s under their prefix, so that
+        // logging, auth or CORS apply to them; everything else unmatched is
+        // answered natively.
+        for(const mw of this.middlewares) {
+            table.addFallbackPrefix(mw.path);
+        }
+        table.setFallback((req, unmatchedStatus, allow) => {
+            let reqPath = req.uri.split("?")[0];
+            let chain = this.middlewares.filter(v => reqPath.startsWith(v.path)).map(v => v.target);
+
+            run_chain(chain, 0, () => {
+                if(unmatchedStatus == 405) {
+                    return req.createResponse().setStatus(405).setHeader("Allow", allow);
+                }
+                return common_response(unmatchedStatus);
+            }, req);
         });
+
+        server.setRouteTable(table);
     }
 
     route(method, path, target) {
@@ -52,17 +67,9 @@ class Endpoint {
     }
 
     addMethod(name, target) {
-        assert(typeof(target) == "function");
+        assert(typeof(target) == "function" || target instanceof NativeRoute);
         this.methodTargets[name.toUpperCase()] = target;
     }
-
-    call(req) {
-        let target = this.methodTargets[req.getMethod()];
-        if(!target) {
-            throw new MethodNotAllowedException();
-        }
-        return target(req);
-    }
 }
 
 class Middleware {
@@ -76,68 +83,149 @@ class Middleware {
     }
 }
 
-class MethodNotAllowedException extends Error {
-    constructor(msg) {
-        super(msg);
+class Detached {
+    constructor() {}
+}
+
+// A route target answered by the native router on the executor threads.
+// Middlewares are not run for these routes.
+class NativeRoute {
+    constructor(install) {
+        this.install = install;
     }
 }
 
-class Detached {
-    constructor() {}
+function staticResponse(template) {
+    return new NativeRoute((table, method, path) => table.addTemplate(method, path, template));
 }
 
-function build_target(ep, mws) {
-    return async function(req) {
-        if(!(await call_middlewares(mws, req))) {
-            return;
-        }
+function redirect(location, status) {
+    return new NativeRoute((table, method, path) => table.addRedirect(method, path, location, status));
+}
+
+function file(filePath) {
+    return new NativeRoute((table, method, path) => table.addFile(method, path, filePath));
+}
+
+function directory(dirPath) {
+    return new NativeRoute((table, method, path) => table.addDirectory(method, path, dirPath));
+}
+
+// Built on first use, as lib.js is only partially loaded when this module is.
+const common_responses = {};
+const common_response_bodies = {
+    404: "Not found\n"
+};
 
-        let ret = null;
+function common_response(status) {
+    return common_responses[status] || (common_responses[status] = new lib.HttpResponseTemplate({
+        status: status,
+        body: common_response_bodies[status]
+    }));
+}
+
+// The middleware chain of each route is resolved once, at build time.
+// Middlewares and targets run synchronously; only when one of them returns
+// a thenable does the rest of the chain continue asynchronously.
+function build_target(target, mws) {
+    let chain = mws.map(v => v.target);
+
+    return function(req) {
+        run_chain(chain, 0, target, req);
+    };
+}
+
+function is_thenable(v) {
+    return v !== null && (typeof(v) == "object" || typeof(v) == "function") && typeof(v.then) == "function";
+}
+
+function run_chain(chain, start, target, req) {
+    for(let i = start; i < chain.length; i++) {
+        let ret;
 
         try {
-            ret = await ep.call(req);
+            ret = chain[i](req);
         } catch(e) {
-            if(e instanceof MethodNotAllowedException) {
-                req.createResponse().setStatus(405).send();
-            } else {
-                console.log(e);
-                req.createResponse().setStatus(500).send();
-            }
+            handle_middleware_error(e, req);
             return;
         }
 
-        if(ret instanceof lib.HttpResponse) {
-            ret.send();
-        } else if(ret instanceof Detached) {
+        if(is_thenable(ret)) {
+            ret.then(
+                () => run_chain(chain, i + 1, target, req),
+                (e) => handle_middleware_error(e, req)
+            );
             return;
-        } else {
-            try {
-                ret = Buffer.from(ret);
-                req.createResponse().setBody(ret).send();
-            } catch(e) {
-                console.log("Warning: Invalid return value from route target");
-                req.createResponse().setStatus(500).send();
-            }
         }
-    };
+    }
+
+    let ret;
+
+    try {
+        ret = target(req);
+    } catch(e) {
+        send_internal_error(e, req);
+        return;
+    }
+
+    if(is_thenable(ret)) {
+        ret.then((v) => try_send_result(v, req), (e) => send_internal_error(e, req));
+    } else {
+        try_send_result(ret, req);
+    }
 }
 
-async function call_middlewares(mws, req) {
-    for(const mw of mws) {
+// Errors here must not escape into the native route callback.
+function try_send_result(ret, req) {
+    try {
+        send_result(ret, req);
+    } catch(e) {
+        send_internal_error(e, req);
+    }
+}
+
+function send_internal_error(e, req) {
+    console.log(e);
+    if(!req.responded) {
+        common_response(500).sendTo(req);
+    }
+}
+
+function send_result(ret, req) {
+    if(ret instanceof lib.HttpResponse) {
+        ret.send();
+    } else if(ret instanceof lib.HttpResponseTemplate) {
+        ret.sendTo(req);
+    } else if(ret instanceof Detached) {
+        return;
+    } else {
         try {
-            await mw.call(req);
-        } catch(e) {
-            if(e instanceof lib.HttpResponse) {
-                e.send();
-            } else {
-                console.log(e);
-                req.createResponse().setStatus(500).send();
+            if(typeof(ret) != "string") {
+                ret = Buffer.from(ret);
             }
-            return false;
+            req.createResponse().setBody(ret).send();
+        } catch(e) {
+            console.log("Warning: Invalid return value from route target");
+            common_response(500).sendTo(req);
         }
     }
-    return true;
-};
+}
+
+function handle_middleware_error(e, req) {
+    if(e instanceof lib.HttpResponse) {
+        e.send();
+    } else if(e instanceof lib.HttpResponseTemplate) {
+        e.sendTo(req);
+    } else {
+        console.log(e);
+        common_response(500).sendTo(req);
+    }
+}
 
 module.exports.Router = Router;
 module.exports.Detached = Detached;
+module.exports.NativeRoute = NativeRoute;
+module.exports.staticResponse = staticResponse;
+module.exports.redirect = redirect;
+module.exports.file = file;
+module.exports.directory = directory;
@@ -1,6 +1,11 @@
 const core = require("./build/Release/ice_node_v4_core");
 const assert = require("assert");
 
+// Call statuses passed back by rpc_client_pool_call.
+const POOL_CALL_DEADLINE_EXCEEDED = 1;
+const POOL_CALL_NO_CONNECTION = 2;
+const POOL_CALL_FAILED = 3;
+
 class RpcServerConfig {
     constructor() {
         this.inst = core.rpc_server_config_create();
@@ -55,12 +60,31 @@ class RpcCallContext {
         return new RpcParam(core.rpc_call_context_get_param(this.inst, pos));
     }
 
+    // Returns all params as plain JS values with a single native call.
+    // `signature` gives one type per param: "i" (i32), "f" (f64), "s"
+    // (string) or "b" (bool). Null and error params become null and an
+    // Error whatever their declared type. Throws a TypeError if the call
+    // has more params than the signature declares.
+    getParams(signature) {
+        assert(this.inst);
+        assert(typeof(signature) == "string");
+        return core.rpc_call_context_get_params_as_js(this.inst, signature);
+    }
+
     end(ret) {
         assert(this.inst);
         assert(ret instanceof RpcParam && ret.inst);
         core.rpc_call_context_end(this.inst, ret.inst);
         ret.inst = null;
     }
+
+    // Ends the call with a number, string, boolean, null or Error, which is
+    // converted to a param natively.
+    endWith(value) {
+        assert(this.inst);
+        core.rpc_call_context_end_with_js(this.inst, value);
+        this.inst = null;
+    }
 }
 
 class RpcClient {
@@ -99,6 +123,40 @@ class RpcClientConnection {
         this.inst = null;
     }
 
+    // Issues several calls in one native crossing. `calls` is a list of
+    // [methodName, params] pairs, where params may hold RpcParams or plain
+    // values. The replies (an RpcParam or null each) are passed to `cb` as
+    // one array once all have arrived; without `cb` a Promise is returned.
+    callMany(calls, cb) {
+        assert(this.inst);
+        assert(Array.isArray(calls));
+
+        let nativeCalls = calls.map(c => {
+            assert(Array.isArray(c) && typeof(c[0]) == "string" && Array.isArray(c[1]));
+            return [c[0], c[1].map(v => unwrap_param(v))];
+        });
+
+        let run = (done) => {
+            core.rpc_client_connection_call_many(this.inst, nativeCalls, function (results) {
+                done(results.map(v => v ? new RpcParam(v) : null));
+            });
+        };
+
+        if(cb) {
+            assert(typeof(cb) == "function");
+            run(cb);
+        } else {
+            return new Promise(run);
+        }
+    }
+
+    // `signature` is either the number of arguments, or a string with one
+    // type per argument as for RpcCallContext.getParams.
+    prepare(methodName, signature) {
+        assert(this.inst);
+        return new RpcPreparedCall(this, methodName, signature);
+    }
+
     call(methodName, _params, cb) {
         assert(this.inst);
         assert(typeof(methodName) == "string");
@@ -124,6 +182,200 @@ class RpcClientConnection {
     }
 }
 
+function unwrap_param(v, type) {
+    if(v instanceof RpcParam) {
+        assert(v.inst);
+        let inst = v.inst;
+        v.inst = null;
+        return inst;
+    }
+    check_plain_param(v, type);
+    return v;
+}
+
+const PLAIN_PARAM_TYPE_CHECKS = {
+    i: v => typeof(v) == "number" && (v | 0) === v,
+    f: v => typeof(v) == "number",
+    s: v => typeof(v) == "string",
+    b: v => typeof(v) == "boolean"
+};
+
+// Values converted to params natively. With `type` (one of i, f, s or b)
+// set, the value must also fit that type, or be null or an Error.
+function check_plain_param(v, type) {
+    let t = typeof(v);
+    if(!(v === null || t == "number" || t == "string" || t == "boolean" || v instanceof Error)) {
+        throw new TypeError("Unsupported RPC param value: " + (t == "object" ? Object.prototype.toString.call(v) : t));
+    }
+    if(type && v !== null && !(v instanceof Error) && !PLAIN_PARAM_TYPE_CHECKS[type](v)) {
+        throw new TypeError("RPC param value " + String(v) + " does not match declared type '" + type + "'");
+    }
+}
+
+// A reusable call to one method with a fixed number of arguments. Each
+// argument may be an RpcParam or a plain number, string, boolean, null or
+// Error. Given a signature, plain numbers are sent with the declared type
+// (so 1 is sent as f64 for 'f'); otherwise integral numbers go as i32.
+class RpcPreparedCall {
+    constructor(conn, methodName, signature) {
+        assert(conn instanceof RpcClientConnection);
+        assert(typeof(methodName) == "string");
+
+        if(typeof(signature) == "string") {
+            assert(/^[ifsb]*$/.test(signature));
+            this.arity = signature.length;
+            this.signature = signature;
+        } else {
+            assert(typeof(signature) == "number" && signature >= 0);
+            this.arity = signature;
+            this.signature = "";
+        }
+
+        this.conn = conn;
+        this.inst = core.rpc_prepared_call_create(methodName, this.arity, this.signature);
+    }
+
+    call(params, cb) {
+        assert(this.inst && this.conn.inst);
+        assert(Array.isArray(params) && params.length == this.arity);
+        assert(typeof(cb) == "function");
+
+        for(let i = 0; i < params.length; i++) {
+            if(params[i] instanceof RpcParam) {
+                params = params.map((v, j) => unwrap_param(v, this.signature[j]));
+                break;
+            }
+            check_plain_param(params[i], this.signature[i]);
+        }
+
+        core.rpc_prepared_call_invoke(this.inst, this.conn.inst, params, function (ret) {
+            if(ret) {
+                cb(new RpcParam(ret));
+            } else {
+                cb(null);
+            }
+        });
+    }
+}
+
+function pool_call_error(message, methodName, code) {
+    let e = new Error(message + methodName);
+    e.code = code;
+    return e;
+}
+
+// Connections to one or more addresses, `connectionsPerAddress` each.
+// Calls go to the connection with the fewest outstanding requests, and
+// connections that fail are re-established in the background.
+//
+// Options:
+// - connectionsPerAddress: defaults to 1.
+// - connectWait: milliseconds a call without a deadline waits for a usable
+//   connection before failing. Defaults to 5000.
+class RpcClientPool {
+    constructor(addrs, options) {
+        if(typeof(addrs) == "string") addrs = [addrs];
+        assert(Array.isArray(addrs) && addrs.length);
+        options = options || {};
+
+        let connsPerAddr = options.connectionsPerAddress || 1;
+        assert(typeof(connsPerAddr) == "number" && connsPerAddr > 0);
+
+        let connectWait = options.connectWait || 0;
+        assert(typeof(connectWait) == "number" && connectWait >= 0);
+
+        this.inst = core.rpc_client_pool_create(addrs, connsPerAddr, connectWait);
+    }
+
+    // Calls that have not completed fail with an Error whose code is
+    // "ENOTCONN"; replies that arrive later are dropped.
+    destroy() {
+        assert(this.inst);
+        core.rpc_client_pool_destroy(this.inst);
+        this.inst = null;
+    }
+
+    // Params may hold RpcParams or plain values. `cb` is called as
+    // cb(err, reply) with an RpcParam reply; without `cb` a Promise is
+    // returned. A call that gets no reply fails with an Error whose code is
+    // "ECALLFAILED".
+    //
+    // Calls made while no connection is usable wait for one. If none comes
+    // up in time, the call fails with an Error whose code is "ENOTCONN".
+    //
+    // Options:
+    // - deadline: milliseconds after which the call fails with an Error
+    //   whose code is "ETIMEDOUT". This also bounds the wait for a
+    //   connection.
+    // - hedgeAfter: milliseconds, or a latency percentile such as "p95",
+    //   after which a duplicate call is sent to another connection,
+    //   preferably on another address. The first reply wins. A percentile
+    //   is taken over recent calls to the address the call is sent to, and
+    //   has no effect until there are enough of them.
+    call(methodName, params, options, cb) {
+        assert(this.inst);
+        assert(typeof(methodName) == "string");
+        assert(Array.isArray(params));
+
+        if(typeof(options) == "function") {
+            cb = options;
+            options = null;
+        }
+        options = options || {};
+
+        let deadline = options.deadline || 0;
+        assert(typeof(deadline) == "number" && deadline >= 0);
+
+        let hedgeMs = 0, hedgePercentile = 0;
+        if(typeof(options.hedgeAfter) == "string") {
+            let m = /^p(\d+(\.\d+)?)$/.exec(options.hedgeAfter);
+            assert(m && m[1] > 0 && m[1] < 100);
+            hedgePercentile = parseFloat(m[1]);
+        } else if(options.hedgeAfter !== undefined) {
+            assert(typeof(options.hedgeAfter) == "number" && options.hedgeAfter > 0);
+            hedgeMs = options.hedgeAfter;
+        }
+
+        let nativeParams = params.map(v => unwrap_param(v));
+
+        let run = (done) => {
+            core.rpc_client_pool_call(this.inst, methodName, nativeParams, function (ret, status) {
+                if(status == POOL_CALL_DEADLINE_EXCEEDED) {
+                    done(pool_call_error("RPC deadline exceeded: ", methodName, "ETIMEDOUT"));
+                } else if(status == POOL_CALL_NO_CONNECTION) {
+                    done(pool_call_error("No RPC connection available: ", methodName, "ENOTCONN"));
+                } else if(status == POOL_CALL_FAILED || !ret) {
+                    done(pool_call_error("RPC call failed: ", methodName, "ECALLFAILED"));
+                } else {
+                    done(null, new RpcParam(ret));
+                }
+            }, deadline, hedgeMs, hedgePercentile);
+        };
+
+        if(cb) {
+            assert(typeof(cb) == "function");
+            run(cb);
+        } else {
+            return new Promise((resolve, reject) => run((err, ret) => err ? reject(err) : resolve(ret)));
+        }
+    }
+
+    // One entry per address: {address, connected, inflight, calls,
+    // failures, avgLatencyMicros, p50LatencyMicros, p90LatencyMicros,
+    // p99LatencyMicros}. The percentiles cover recent successful calls and
+    // are null until there are enough of them.
+    getStats() {
+        assert(this.inst);
+        return core.rpc_client_pool_stats(this.inst);
+    }
+
+    // {hedgesIssued, hedgesWon, deadlinesExceeded} since the pool was created.
+    getCounters() {
+        assert(this.inst);
+        return core.rpc_client_pool_counters(this.inst);
+    }
+}
+
 class RpcParam {
     constructor(inst) {
         assert(inst);
@@ -156,6 +408,19 @@ class RpcParam {
         return core.rpc_param_get_bool(this.inst);
     }
 
+    // Returns the bytes held by a param built with buildBuffer or
+    // buildFloat64Array, or null if it holds none. Bytes travel as tagged
+    // base64 strings, so ordinary string params are never read as bytes.
+    getBuffer() {
+        assert(this.inst);
+        return core.rpc_param_get_bytes(this.inst);
+    }
+
+    getFloat64Array() {
+        assert(this.inst);
+        return core.rpc_param_get_float64_array(this.inst);
+    }
+
     getError() {
         assert(this.inst);
         let e = core.rpc_param_get_error(this.inst);
@@ -186,6 +451,16 @@ class RpcParam {
         return new RpcParam(core.rpc_param_build_string(v));
     }
 
+    static buildBuffer(v) {
+        assert(v instanceof Buffer || ArrayBuffer.isView(v));
+        return new RpcParam(core.rpc_param_build_bytes(v));
+    }
+
+    static buildFloat64Array(v) {
+        assert(v instanceof Float64Array);
+        return new RpcParam(core.rpc_param_build_bytes(v));
+    }
+
     static buildError(v) {
         assert(v instanceof RpcParam && v.inst);
         let newParam = new RpcParam(core.rpc_param_build_error(v.inst));
@@ -209,3 +484,5 @@ module.exports.RpcCallContext = RpcCallContext;
 module.exports.RpcParam = RpcParam;
 module.exports.RpcClient = RpcClient;
 module.exports.RpcClientConnection = RpcClientConnection;
+module.exports.RpcPreparedCall = RpcPreparedCall;
+module.exports.RpcClientPool = RpcClientPool;
@@ -21,9 +21,57 @@ cfg.addMethod("add_string", (ctx) => {
     );
 });
 
+cfg.addMethod("describe", (ctx) => {
+    let [a, b, c, d, e] = ctx.getParams("ifssb");
+    if(a < 0) {
+        ctx.endWith(new Error("Negative"));
+    } else {
+        ctx.endWith([a, b, c, d, e].join(","));
+    }
+});
+
+cfg.addMethod("half", (ctx) => {
+    let [x] = ctx.getParams("f");
+    ctx.endWith(x / 2);
+});
+
+cfg.addMethod("check_signature", (ctx) => {
+    try {
+        ctx.getParams("i");
+        ctx.endWith("accepted");
+    } catch(e) {
+        ctx.endWith(e.name);
+    }
+});
+
+cfg.addMethod("scale", (ctx) => {
+    let factor = ctx.getParam(0).getF64();
+    let v = ctx.getParam(1).getFloat64Array();
+    ctx.end(rpc.RpcParam.buildFloat64Array(v.map(x => x * factor)));
+});
+cfg.addMethod("reverse_bytes", (ctx) => {
+    let buf = ctx.getParam(0).getBuffer();
+    ctx.end(rpc.RpcParam.buildBuffer(buf.reverse()));
+});
+
+cfg.addMethod("delay", (ctx) => {
+    let ms = ctx.getParam(0).getI32();
+    setTimeout(() => ctx.endWith(ms), ms);
+});
+
 let server = new rpc.RpcServer(cfg);
 server.start("127.0.0.1:1653");
 
+// A replica that answers "add" slowly, for the hedging test.
+let slowCfg = new rpc.RpcServerConfig();
+slowCfg.addMethod("add", (ctx) => {
+    let [a, b] = ctx.getParams("ii");
+    setTimeout(() => ctx.endWith(a + b), 300);
+});
+
+let slowServer = new rpc.RpcServer(slowCfg);
+slowServer.start("127.0.0.1:1654");
+
 let client = new rpc.RpcClient("127.0.0.1:1653");
 client.connect(async conn => {
     try {
@@ -31,6 +79,17 @@ client.connect(async conn => {
         await testPing(conn);
         await testAdd(conn);
         await testAddString(conn);
+        await testAddStringNonAscii(conn);
+        await testDescribe(conn);
+        await testBinary(conn);
+        await testPrepared(conn);
+        await testCallMany(conn);
+        await testResourceStats();
+        await testUnreferencedClient();
+        await testPool();
+        await testPoolDeadline();
+        await testPoolNoConnection();
+        await testPoolHedging();
         console.log("Done");
     } catch(e) {
         console.log(e);
@@ -78,3 +137,302 @@ function testAddString(conn) {
         });
     });
 }
+
+function testAddStringNonAscii(conn) {
+    let long = "x".repeat(1000);
+
+    return new Promise(cb => {
+        conn.call("add_string", [
+            rpc.RpcParam.buildString("Grüße, "),
+            rpc.RpcParam.buildString("世界 " + long)
+        ], ret => {
+            let v = ret.getString();
+            assert(v === "Grüße, 世界 " + long);
+            ret.destroy();
+            console.log("[+] testAddStringNonAscii OK");
+            cb();
+        });
+    });
+}
+
+function testDescribe(conn) {
+    return new Promise(cb => {
+        conn.call("describe", [
+            rpc.RpcParam.buildI32(7),
+            rpc.RpcParam.buildF64(0.5),
+            rpc.RpcParam.buildString("x"),
+            rpc.RpcParam.buildNull(),
+            rpc.RpcParam.buildBool(true)
+        ], ret => {
+            assert(ret.getString() === "7,0.5,x,,true");
+            ret.destroy();
+
+            conn.call("describe", [rpc.RpcParam.buildI32(-1)], ret => {
+                let e = ret.getError();
+                assert(e && e.getString() === "Negative");
+                e.destroy();
+                ret.destroy();
+
+                conn.call("check_signature", [rpc.RpcParam.buildI32(1), rpc.RpcParam.buildI32(2)], ret => {
+                    assert(ret.getString() === "TypeError");
+                    ret.destroy();
+                    console.log("[+] testDescribe OK");
+                    cb();
+                });
+            });
+        });
+    });
+}
+
+function testBinary(conn) {
+    return new Promise(cb => {
+        let bytes = Buffer.from([0, 1, 2, 250, 251, 255, 7]);
+        conn.call("reverse_bytes", [rpc.RpcParam.buildBuffer(bytes)], ret => {
+            assert(ret.getBuffer().equals(Buffer.from(bytes).reverse()));
+            ret.destroy();
+
+            conn.call("scale", [
+                rpc.RpcParam.buildF64(2),
+                rpc.RpcParam.buildFloat64Array(new Float64Array([1.5, -3, 1e100]))
+            ], ret => {
+                let v = ret.getFloat64Array();
+                assert(v.length == 3 && v[0] === 3 && v[1] === -6 && v[2] === 2e100);
+                ret.destroy();
+
+                // Only tagged strings hold bytes, and padding is only
+                // accepted at the end of the last quartet.
+                let decode = (s, tag = "\x01b64:") => {
+                    let p = rpc.RpcParam.buildString(tag + s);
+                    let buf = p.getBuffer();
+                    p.destroy();
+                    return buf;
+                };
+                assert(decode("YQ==").toString() == "a" && decode("YWI=").toString() == "ab");
+                for(let s of ["abc", "ab=c", "YQ=a", "AA==AAAA", "AB=="]) {
+                    assert(decode(s) === null);
+                }
+                assert(decode("Pong", "") === null && decode("YQ==", "") === null);
+                console.log("[+] testBinary OK");
+                cb();
+            });
+        });
+    });
+}
+
+function testPrepared(conn) {
+    let ping = conn.prepare("ping", 0);
+    let add = conn.prepare("add", 2);
+
+    return new Promise(cb => {
+        ping.call([], ret => {
+            assert(ret.getString() == "Pong");
+            ret.destroy();
+
+            let remaining = 100;
+            for(let i = 0; i < 100; i++) {
+                add.call([i, rpc.RpcParam.buildI32(i)], ret => {
+                    assert(ret.getI32() == i * 2);
+                    ret.destroy();
+                    if(--remaining == 0) {
+                        testPreparedSignature(conn).then(() => {
+                            console.log("[+] testPrepared OK");
+                            cb();
+                        });
+                    }
+                });
+            }
+        });
+    });
+}
+
+function testPreparedSignature(conn) {
+    // Plain numbers follow the declared type, not their runtime value.
+    let half = conn.prepare("half", "f");
+    assert.throws(() => conn.prepare("add", "ii").call([1.5, 1], () => {}), TypeError);
+    assert.throws(() => half.call(["1"], () => {}), TypeError);
+
+    return new Promise(cb => {
+        half.call([1], ret => {
+            assert(ret.getF64() === 0.5);
+            ret.destroy();
+
+            conn.prepare("add", "ii").call([2, rpc.RpcParam.buildI32(3)], ret => {
+                assert(ret.getI32() == 5);
+                ret.destroy();
+                cb();
+            });
+        });
+    });
+}
+
+async function testCallMany(conn) {
+    let calls = [["ping", []]];
+    for(let i = 0; i < 50; i++) {
+        calls.push(["add", [i, rpc.RpcParam.buildI32(1)]]);
+    }
+    calls.push(["no_such_method", []]);
+
+    let results = await conn.callMany(calls);
+    assert(results.length == 52);
+    assert(results[0].getString() == "Pong");
+    for(let i = 0; i < 50; i++) {
+        assert(results[i + 1].getI32() == i + 1);
+    }
+    assert(results[51] === null);
+    results.forEach(v => v && v.destroy());
+
+    assert((await conn.callMany([])).length == 0);
+
+    for(const bad of [Buffer.from("x"), new Float64Array(1), {}, undefined]) {
+        assert.throws(() => conn.callMany([["ping", [bad]]]), TypeError);
+        assert.throws(() => conn.prepare("ping", 1).call([bad], () => {}), TypeError);
+    }
+    console.log("[+] testCallMany OK");
+}
+
+async function waitConnected(pool, n) {
+    while(pool.getStats().some(s => s.connected < n)) {
+        await new Promise(cb => setTimeout(cb, 10));
+    }
+}
+
+async function testPool() {
+    // Calls made before any connection is up wait for one.
+    let pool = new rpc.RpcClientPool(["127.0.0.1:1653"], { connectionsPerAddress: 2 });
+
+    let results = await Promise.all(
+        Array.from({ length: 20 }, (_, i) => pool.call("add", [i, 1]))
+    );
+    results.forEach((v, i) => {
+        assert(v.getI32() == i + 1);
+        v.destroy();
+    });
+
+    // Callbacks are error-first, and a call without a reply is an error.
+    await new Promise(cb => pool.call("add", [1, 2], (err, ret) => {
+        assert(err === null && ret.getI32() == 3);
+        ret.destroy();
+        pool.call("no_such_method", [], (err, ret) => {
+            assert(err.code == "ECALLFAILED" && ret === undefined);
+            cb();
+        });
+    }));
+
+    let stats = pool.getStats();
+    assert(stats[0].address == "127.0.0.1:1653");
+    assert(stats[0].p50LatencyMicros > 0 && stats[0].p50LatencyMicros <= stats[0].p99LatencyMicros);
+    assert(stats[0].calls == 22 && stats[0].inflight == 0 && stats[0].failures == 1);
+    pool.destroy();
+    console.log("[+] testPool OK");
+}
+
+async function testPoolDeadline() {
+    let pool = new rpc.RpcClientPool("127.0.0.1:1653");
+
+    let ret = await pool.call("delay", [10], { deadline: 1000 });
+    assert(ret.getI32() == 10);
+    ret.destroy();
+
+    let err = null;
+    try {
+        await pool.call("delay", [500], { deadline: 50 });
+    } catch(e) {
+        err = e;
+    }
+    assert(err && err.code == "ETIMEDOUT");
+    assert(pool.getCounters().deadlinesExceeded == 1);
+    pool.destroy();
+    console.log("[+] testPoolDeadline OK");
+}
+
+async function testPoolNoConnection() {
+    let pool = new rpc.RpcClientPool("127.0.0.1:1655", { connectWait: 50 });
+
+    let errs = await Promise.all([
+        pool.call("add", [1, 2]).catch(e => e),
+        pool.call("add", [1, 2], { deadline: 20 }).catch(e => e)
+    ]);
+    assert(errs[0].code == "ENOTCONN");
+    assert(errs[1].code == "ETIMEDOUT");
+
+    // Destroying the pool fails calls that are still waiting.
+    let pending = pool.call("add", [1, 2]).catch(e => e);
+    pool.destroy();
+    assert((await pending).code == "ENOTCONN");
+
+    // Calls still waiting for a reply fail too, rather than keeping the
+    // pool alive until the peer answers.
+    pool = new rpc.RpcClientPool("127.0.0.1:1653");
+    (await pool.call("add", [1, 2])).destroy();
+    let stalled = pool.call("delay", [2000]).then(ret => ret, e => e);
+    await new Promise(cb => setTimeout(cb, 20));
+    assert(pool.getStats()[0].inflight == 1);
+    pool.destroy();
+    let err = await stalled;
+    assert(err instanceof Error && err.code == "ENOTCONN");
+    console.log("[+] testPoolNoConnection OK");
+}
+
+async function testPoolHedging() {
+    let pool = new rpc.RpcClientPool(["127.0.0.1:1653", "127.0.0.1:1654"]);
+    await waitConnected(pool, 1);
+
+    let results = await Promise.all(
+        Array.from({ length: 10 }, (_, i) => pool.call("add", [i, 1], { hedgeAfter: 50, deadline: 2000 }))
+    );
+    results.forEach((v, i) => {
+        assert(v.getI32() == i + 1);
+        v.destroy();
+    });
+
+    let counters = pool.getCounters();
+    assert(counters.hedgesWon > 0 && counters.hedgesWon <= counters.hedgesIssued);
+    assert(counters.deadlinesExceeded == 0);
+
+    // Percentile hedging needs enough recent samples from the chosen
+    // address, so it starts as a no-op.
+    let ret = await pool.call("add", [1, 2], { hedgeAfter: "p95" });
+    assert(ret.getI32() == 3);
+    ret.destroy();
+    pool.destroy();
+
+    // Once an address has enough samples, its percentile sets the delay.
+    pool = new rpc.RpcClientPool("127.0.0.1:1653", { connectionsPerAddress: 2 });
+    for(let i = 0; i < 30; i++) {
+        (await pool.call("add", [i, 1])).destroy();
+    }
+    for(let i = 0; i < 5; i++) {
+        ret = await pool.call("add", [i, 1], { hedgeAfter: "p50" });
+        assert(ret.getI32() == i + 1);
+        ret.destroy();
+    }
+    assert(pool.getStats()[0].calls >= 35);
+    pool.destroy();
+    console.log("[+] testPoolHedging OK");
+}
+
+function testResourceStats() {
+    let before = lib.nativeResourceStats().RpcParam;
+    let params = [rpc.RpcParam.buildI32(1), rpc.RpcParam.buildString("x"), rpc.RpcParam.buildNull()];
+    assert(lib.nativeResourceStats().RpcParam == before + 3);
+
+    params.forEach(p => p.destroy());
+    assert(lib.nativeResourceStats().RpcParam == before);
+    console.log("[+] testResourceStats OK");
+}
+
+// The client must stay alive until its connect completes, even when nothing
+// else references it. Run with --expose-gc to force a collection meanwhile.
+function testUnreferencedClient() {
+    return new Promise(cb => {
+        new rpc.RpcClient("127.0.0.1:1653").connect(conn => {
+            assert(conn);
+            conn.destroy();
+            console.log("[+] testUnreferencedClient OK");
+            cb();
+        });
+        if(global.gc) {
+            global.gc();
+        }
+    });
+}
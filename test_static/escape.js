@@ -0,0 +1 @@
+../lib_test.js
\ No newline at end of file